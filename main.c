@@ -1,8 +1,30 @@
+#include <stdint.h>
+#include <time.h>
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#endif
+#include <stdatomic.h>
+#include <math.h>
 #include <curl/curl.h>
 #include <SFML/Graphics.h>
 #include "utils/utils.h"
 #include "dbg/dbg.h"
-#include "BbQueue/BbQueue.h"
 
 // Update tick frequency
 #define UPDATE_TICK_FREQUENCY 0.01
@@ -10,7 +32,452 @@
 // Size in pixels between each tick on X axis
 #define X_TILE_SIZE 150
 
+// Maximum number of URLs downloaded in parallel
+#define MAX_STREAMS 8
+
+// Smallest segment in bytes worth being split in two for a stream done with its own
+#define SEGMENT_MIN_SPLIT (4 * 1024 * 1024)
+
+// Attempts to resume a segment after its transfer failed, before giving up on it
+#define SEGMENT_MAX_RETRIES 3
+
+// Generated bytes sent in a loop when uploading
+#define UPLOAD_BUFFER_SIZE (1024 * 1024)
+
+// Staging buffers handed to the disk writer thread, aligned for direct I/O
+#define DISK_BUFFER_SIZE (1024 * 1024)
+#define DISK_BUFFER_COUNT (MAX_STREAMS * 2) // Each stream keeps one while filling it
+#define DISK_BUFFER_ALIGNMENT 4096
+
+// Duration in seconds of the window used for the current speed
+#define SPEED_WINDOW_DURATION 1.0
+
+// Initial number of samples the speed window can hold (grows when needed)
+#define SPEED_WINDOW_CAPACITY 1024
+
+// Number of samples the render thread can lag behind (power of 2)
+#define SAMPLE_CHANNEL_CAPACITY 4096
+
+// Used for keeping the producer and consumer indices on separate cache lines
+#define CACHE_LINE_SIZE 64
+
+// Number of samples per history chunk
+#define HISTORY_CHUNK_SIZE 4096
+
+// Seconds after which the curves vertices are moved back close to X = 0, for float precision
+#define TIME_ORIGIN_REBASE_PERIOD 600.0
+
+// Samples aggregated by each leaf of the range tree
+#define RANGE_TREE_BLOCK 64
+
+// Number of resolutions kept for the history overview
+#define PYRAMID_LEVEL_COUNT 4
+
+// Colors of the streams curves, when downloading several URLs
+static const sfUint8 streamColors[MAX_STREAMS][3] = {
+    {0, 200, 255}, {0, 255, 120}, {255, 0, 255}, {255, 140, 0},
+    {120, 120, 255}, {255, 255, 255}, {0, 255, 255}, {180, 255, 0}
+};
+
+// TCP state of a connection, read with TCP_INFO at each sample
+typedef enum {
+    TCP_RTT, // ms
+    TCP_CWND, // Segments
+    TCP_RETRANSMITS, // Since the connection started
+    TCP_RCV_SPACE, // KB
+    TCP_SERIES_COUNT
+} TcpSeries;
+
+static const char *tcpSeriesFormats[TCP_SERIES_COUNT] = {
+    [TCP_RTT] = "RTT : %.1f ms",
+    [TCP_CWND] = "cwnd : %.0f segments",
+    [TCP_RETRANSMITS] = "Retransmits : %.0f",
+    [TCP_RCV_SPACE] = "Receive space : %.0f KB"
+};
+
+static const sfUint8 tcpColors[TCP_SERIES_COUNT][4] = {
+    [TCP_RTT] = {255, 120, 120, 180},
+    [TCP_CWND] = {120, 255, 200, 180},
+    [TCP_RETRANSMITS] = {255, 40, 40, 180},
+    [TCP_RCV_SPACE] = {180, 180, 255, 180}
+};
+
+// Phases of a transfer, from CURL timings
+typedef enum {
+    PHASE_DNS,
+    PHASE_CONNECT,
+    PHASE_TLS,
+    PHASE_FIRST_BYTE, // Request sent, waiting for the answer
+    PHASE_TRANSFER,
+    PHASE_COUNT
+} Phase;
+
+static const char *phaseNames[PHASE_COUNT] = {"DNS", "Connect", "TLS", "TTFB", "Transfer"};
+
+static const sfUint8 phaseColors[PHASE_COUNT][3] = {
+    [PHASE_DNS] = {80, 80, 255},
+    [PHASE_CONNECT] = {0, 200, 200},
+    [PHASE_TLS] = {200, 0, 200},
+    [PHASE_FIRST_BYTE] = {255, 160, 0},
+    [PHASE_TRANSFER] = {90, 90, 90}
+};
+
+// Height in pixels of the phases band under the X axis
+#define PHASE_BAND_HEIGHT 6
+
+// Rolling speed estimators shown as selectable curves, on top of the current speed
+#define MAX_ESTIMATORS 6
+
+static const sfUint8 estimatorColors[MAX_ESTIMATORS][3] = {
+    {255, 255, 160}, {255, 200, 80}, {160, 255, 255}, {80, 200, 255}, {255, 160, 255}, {200, 120, 255}
+};
+
+// Y axis autoscale : some room above the highest visible point, and no shrinking
+// until the curves use less than AUTOSCALE_SHRINK of the axis
+#define AUTOSCALE_HEADROOM 1.2
+#define AUTOSCALE_SHRINK 0.5
+#define AUTOSCALE_MIN 10.0 // KB/s
+
+// Log scale Y axis : the vertices stay in KB/s and this shader takes their
+// decimal logarithm, speeds under 1 KB/s being drawn at the bottom.
+// The plot transform is a uniform (X scale, X offset, Y scale, Y offset) rather than the
+// render states transform, which SFML applies on the CPU to draws of 4 vertices or less.
+static const char *logVertexShader =
+    "uniform vec4 plotTransform;\n"
+    "void main () {\n"
+    "    vec4 vertex = gl_Vertex;\n"
+    "    vertex.x = vertex.x * plotTransform.x + plotTransform.y;\n"
+    "    vertex.y = log2(max(vertex.y, 1.0)) * 0.30103 * plotTransform.z + plotTransform.w;\n"
+    "    gl_Position = gl_ModelViewProjectionMatrix * vertex;\n"
+    "    gl_FrontColor = gl_Color;\n"
+    "}\n";
+
+static const char *logFragmentShader =
+    "void main () {\n"
+    "    gl_FragColor = gl_Color;\n"
+    "}\n";
+
+// Log-linear histogram of the speeds : each doubling of the speed is split in
+// linear sub-buckets, so every quantile is within 1 / QUANTILE_SUB_BUCKETS of the real one
+#define QUANTILE_SUB_BUCKETS 64
+#define QUANTILE_DOUBLINGS 36 // From QUANTILE_MIN_SPEED to QUANTILE_MIN_SPEED * 2^36
+#define QUANTILE_MIN_SPEED 0.125 // KB/s, slower samples are counted as 0
+#define QUANTILE_BUCKET_COUNT (QUANTILE_DOUBLINGS * QUANTILE_SUB_BUCKETS + 1)
+
+// The rolling window is made of slices, the oldest one being recycled as a whole
+#define QUANTILE_WINDOW_DURATION 60.0
+#define QUANTILE_WINDOW_SLICES 6
+
+#define QUANTILE_COUNT 5
+static const double quantiles[QUANTILE_COUNT] = {0.01, 0.05, 0.50, 0.95, 0.99};
+
+// Bucket duration in seconds of each overview resolution, from the finest to the coarsest
+static const double pyramidLevelDurations[PYRAMID_LEVEL_COUNT] = {1, 10, 60, 600};
+
+// Seconds shown on the X axis for each view selectable with the number keys, 0 being the live view
+#define VIEW_SPAN_COUNT 4
+static const double viewSpans[VIEW_SPAN_COUNT] = {0, 10 * 60, 60 * 60, 24 * 60 * 60};
+
+// Shortest span of the history view in seconds, and zoom of one mouse wheel notch
+#define VIEW_MIN_SPAN 1.0
+#define VIEW_ZOOM_FACTOR 1.25
+
+// Maximum number of frames rendered per second
+#define FRAME_RATE_LIMIT 60
+
+// Milliseconds the main loop sleeps at most when nothing happens, for polling window events
+#define IDLE_POLL_PERIOD 50
+
+// Milliseconds between two flushes of the samples in headless mode
+#define HEADLESS_FLUSH_PERIOD 50
+
+// Size of the buffer used for writing samples in headless mode
+#define HEADLESS_BUFFER_SIZE (1024 * 1024)
+
+// Sample log file identification
+#define SAMPLE_LOG_MAGIC "BWPLOT\0\0"
+#define SAMPLE_LOG_VERSION 5
+
+// Test server : size of the generated file sent in loop, biggest chunk sent at once,
+// and milliseconds between two sends when throttled
+#define TEST_SERVER_DATA_SIZE (4 * 1024 * 1024)
+#define TEST_SERVER_CHUNK_SIZE (256 * 1024)
+#define TEST_SERVER_SLICE 5
+
+// Milliseconds the test server waits before accepting again after an error, such as running out of descriptors
+#define TEST_SERVER_ACCEPT_BACKOFF 100
+
+// Default size in MB of the test server responses
+#define TEST_SERVER_CONTENT_SIZE 1024
+
 /** === Type declaration === */
+typedef struct {
+    double time;
+    double size; // Cumulative size downloaded at this time
+} SpeedSample;
+
+typedef struct {
+    // Ring buffer of samples, ordered by time
+    // Slots are recycled in place : no allocation happens once the ring is big enough
+    SpeedSample *samples;
+    size_t capacity; // Always a power of 2
+    size_t head;
+    size_t count;
+
+    // Window length in seconds
+    double duration;
+
+    // Statistics
+    size_t peak; // Highest number of live samples
+    size_t recycled; // Number of expired slots reused
+    size_t grows; // Number of times the ring had to be reallocated
+} SpeedWindow;
+
+typedef struct {
+    double time;
+    double speed;
+    double size;
+    double lastSecondSpeed;
+    double streamSpeed[MAX_STREAMS]; // Current speed of each stream, summed in lastSecondSpeed
+    double diskSpeed; // Speed at which the output file is written
+    double tcp[TCP_SERIES_COUNT]; // TCP state of the first connection, 0 if unknown
+    double estimates[MAX_ESTIMATORS]; // Speed of each rolling estimator
+} VertexData;
+
+typedef enum {
+    ESTIMATOR_WINDOW, // Mean over a fixed duration
+    ESTIMATOR_EWMA // Exponentially weighted moving average
+} EstimatorType;
+
+typedef struct {
+    uint32_t type;
+    uint32_t reserved;
+    double duration; // Window duration or half-life, in seconds
+} EstimatorSpec;
+
+// Speed estimation updated in O(1) per sample
+typedef struct {
+    EstimatorSpec spec;
+    SpeedWindow window; // ESTIMATOR_WINDOW
+    double speed; // ESTIMATOR_EWMA, KB/s
+    double lastTime;
+    double lastSize;
+} Estimator;
+
+// Sample log file header, followed by fixed size VertexData records
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    uint32_t streamCount;
+    uint32_t estimatorCount;
+    char units[8]; // Unit of the sizes, speeds are in units per second
+    int64_t startEpoch; // Unix time of the start of the download
+    double tickPeriod;
+    char url[1024];
+    EstimatorSpec estimators[MAX_ESTIMATORS];
+} SampleLogHeader;
+
+// Sample log mapped in memory for replaying it
+typedef struct {
+    SampleLogHeader *header;
+    VertexData *records;
+    size_t count;
+
+    void *base;
+    size_t size;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+} SampleLog;
+
+// Throughput of the test server over time
+typedef enum {
+    PROFILE_CONSTANT,     // constant:<rate>
+    PROFILE_STEP,         // step:<rate>:<rate2>:<period>
+    PROFILE_SAWTOOTH,     // sawtooth:<rate>:<period>
+    PROFILE_TOKEN_BUCKET, // bucket:<rate>:<burst>
+    PROFILE_STALL,        // stall:<rate>:<period>:<pause>
+    PROFILE_REPLAY        // replay:<sample log>
+} ProfileType;
+
+typedef struct {
+    ProfileType type;
+    double rate; // KB/s
+    double rate2; // KB/s
+    double period; // Seconds
+    double pause; // Seconds
+    double burst; // KB
+    SampleLog trace;
+} ThroughputProfile;
+
+// Direction of the transfers
+typedef enum {
+    TRANSFER_DOWNLOAD,
+    TRANSFER_UPLOAD,
+    TRANSFER_BIDIRECTIONAL // Each URL is downloaded and uploaded to at the same time
+} TransferMode;
+
+// Loopback HTTP server sending generated bytes following a throughput profile
+typedef struct {
+    ThroughputProfile profile;
+    int listenFd;
+    unsigned short port;
+    size_t contentLength;
+    int dataFd; // Generated bytes, sent with sendfile
+} TestServer;
+
+// Single producer (CURL thread) / single consumer (SFML thread) ring buffer
+typedef struct {
+    // Producer side
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t tail;
+    size_t cachedHead; // Last head seen by the producer
+    atomic_size_t dropped; // Samples lost because the ring was full
+
+    // Consumer side
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t head;
+    size_t cachedTail; // Last tail seen by the consumer
+
+    // Samples are copied by value
+    _Alignas(CACHE_LINE_SIZE) VertexData samples[SAMPLE_CHANNEL_CAPACITY];
+} SampleChannel;
+
+// Lets the CURL thread wake the SFML thread up when a new sample is ready
+typedef struct {
+    atomic_bool waiting; // Set by the SFML thread while it sleeps
+#ifdef _WIN32
+    HANDLE event;
+#else
+    int fd;
+#endif
+} Wakeup;
+
+// Phases of the first transfer of the first stream, in seconds on the samples time axis
+typedef struct {
+    double start; // Handle added to the multi handle
+    double ends[PHASE_TRANSFER]; // End of each setup phase
+    atomic_bool ready; // Setup phases known, set once by the CURL thread
+    _Atomic double end; // End of the transfer, 0 while running
+} PhaseTimeline;
+
+// Bytes received, waiting to be written at a given position of the output file
+typedef struct {
+    void *block; // Allocated memory, data is aligned inside it
+    char *data;
+    size_t size;
+    curl_off_t offset;
+} DiskBuffer;
+
+// Writer thread emptying filled staging buffers, so a slow disk doesn't look like a slow network
+typedef struct {
+    FILE *file;
+    bool preallocated;
+    DiskBuffer buffers[DISK_BUFFER_COUNT];
+
+    // Buffers ready to be filled, and filled buffers in writing order, protected by the mutex
+    sfMutex *mutex;
+    DiskBuffer *free[DISK_BUFFER_COUNT];
+    int freeCount;
+    DiskBuffer *queue[DISK_BUFFER_COUNT];
+    int queueHead;
+    int queueCount;
+    bool closing;
+
+    Wakeup filled; // Wakes the writer up
+    Wakeup freed; // Wakes the CURL thread up while it waits for a buffer
+    sfThread *thread;
+
+    atomic_llong written; // Bytes written to disk
+    atomic_bool failed;
+} DiskWriter;
+
+// Columns of the history store
+typedef enum {
+    HISTORY_AVERAGE,
+    HISTORY_CURRENT,
+    HISTORY_DISK,
+    HISTORY_SERIES_COUNT
+} HistorySeries;
+
+typedef struct {
+    double time[HISTORY_CHUNK_SIZE];
+    float values[HISTORY_SERIES_COUNT][HISTORY_CHUNK_SIZE];
+} HistoryChunk;
+
+// Whole run history, stored by columns in fixed size chunks that never move
+typedef struct {
+    HistoryChunk **chunks;
+    size_t chunksCapacity;
+    size_t count;
+} History;
+
+// Aggregate of the samples received during one bucket duration
+typedef struct {
+    float min[HISTORY_SERIES_COUNT];
+    float max[HISTORY_SERIES_COUNT];
+    double sum[HISTORY_SERIES_COUNT];
+    size_t count;
+} PyramidBucket;
+
+typedef struct {
+    double duration;
+
+    // Bucket i covers [i * duration, (i + 1) * duration[
+    PyramidBucket *buckets;
+    size_t count;
+    size_t capacity;
+} PyramidLevel;
+
+// Min / max / mean of the history at several resolutions
+typedef struct {
+    PyramidLevel levels[PYRAMID_LEVEL_COUNT];
+} Pyramid;
+
+// Segment tree over blocks of RANGE_TREE_BLOCK history samples, for the
+// min / max / mean of any range of samples in O(log n)
+typedef struct {
+    PyramidBucket *nodes; // Root at 1, leaf i at leafCapacity + i
+    size_t leafCapacity; // Power of 2
+} RangeTree;
+
+// Count of samples per speed bucket
+typedef struct {
+    uint32_t counts[QUANTILE_BUCKET_COUNT];
+    uint64_t total;
+} Histogram;
+
+// Speed quantiles over the whole run and over the last QUANTILE_WINDOW_DURATION seconds, in constant memory
+typedef struct {
+    Histogram run;
+    Histogram slices[QUANTILE_WINDOW_SLICES];
+    long long slice; // Index of the newest slice since the start
+} QuantileSketch;
+
+typedef struct {
+    double time;
+    double value;
+} MaxSample;
+
+// Maximum of the samples after a given time : a deque of decreasing values,
+// each sample being pushed and popped at most once
+typedef struct {
+    MaxSample *samples;
+    size_t capacity; // Power of 2
+    size_t head;
+    size_t count;
+} SlidingMax;
+
+// Ring buffer of the vertices of a curve in data space
+typedef struct {
+    // Each vertex is stored twice, at i and i + capacity, so the vertices
+    // to draw are always contiguous from head whatever the ring position
+    sfVertex *vertices;
+    size_t capacity;
+    size_t head;
+    size_t count;
+} PlotSeries;
+
 typedef struct {
     float width, height; // screen size
 
@@ -19,12 +486,75 @@ typedef struct {
     sfVector2f padding; // Axis padding
     sfVector2f axisSize; // Axis size
     double startAxisTime;
+    double timeOrigin; // Time at X = 0 for the curves vertices
+    double limitSpeed; // Speed at the top of the Y axis
+    SlidingMax visibleMax; // Highest point of the live view
+    bool logScale;
+    sfShader *logShader; // NULL if shaders are not available
+
+    // History overview
+    double viewSpan; // Seconds shown on the X axis, 0 for the live view
+    double overviewStart; // Time at the start of the X axis
+    bool overviewDirty;
+    sfVertex *overview[HISTORY_SERIES_COUNT]; // Min / max pair per bucket
+    size_t overviewCount;
+    size_t overviewCapacity;
+    double overviewLimit; // Speed at the top of the Y axis in the overview
+    bool followLatest; // The X axis ends on the newest sample, unless panned
+    bool dragging;
+    float dragX; // Mouse X at the previous drag event
+    sfText *rangeText; // Aggregates of the samples on the X axis
+
+    // Crosshair on the sample nearest to the mouse
+    sfVector2f mouse;
+    bool crosshairShown;
+    sfVertex crosshair[4];
+    sfText *crosshairText;
+
+    // Live curves, drawn in a texture used as a ring : the column of a time is its X modulo
+    // the texture width, so only the segments since the previous frame are drawn
+    sfRenderTexture *plotTexture;
+    bool plotDirty; // Draw every curve again at the next frame
+    size_t plotPending; // Samples pushed since the previous frame
+    double plotLimit; // Y axis the texture was drawn with
+    bool plotLogScale;
+
+    // Axis, legends and URL, drawn again only when a legend changes
+    sfRenderTexture *staticTexture;
+    bool staticDirty;
 
     // Progress averageBandwith
-    sfVertexArray *averageBandwith;
-    sfVertexArray *averageBandwithData;
-    sfVertexArray *currentBandwith;
-    sfVertexArray *currentBandwithData;
+    PlotSeries averageBandwith;
+    PlotSeries currentBandwith;
+    PlotSeries diskBandwith;
+    bool diskCurve; // Only shown when the download is written to disk
+
+    // Speed of each stream, stacked on top of the previous ones, when there are several
+    int streamCount;
+    PlotSeries streamBandwith[MAX_STREAMS];
+    sfText *streamLegend[MAX_STREAMS];
+
+    // Curves reduced to at most 4 vertices per pixel column, used when the series are denser than that
+    sfVertex *decimated[HISTORY_SERIES_COUNT];
+    size_t decimatedCount[HISTORY_SERIES_COUNT];
+    sfVertex *streamDecimated[MAX_STREAMS];
+    size_t streamDecimatedCount[MAX_STREAMS];
+
+    // TCP state overlay, each series on its own scale
+    bool tcpOverlay;
+    PlotSeries tcpSeries[TCP_SERIES_COUNT];
+    double tcpLimit[TCP_SERIES_COUNT]; // Value at the top of the Y axis
+    sfVertex *tcpDecimated[TCP_SERIES_COUNT];
+    size_t tcpDecimatedCount[TCP_SERIES_COUNT];
+    sfText *tcpLegend[TCP_SERIES_COUNT];
+
+    // Rolling estimators, each toggled with its function key
+    int estimatorCount;
+    bool estimatorShown[MAX_ESTIMATORS];
+    PlotSeries estimatorSeries[MAX_ESTIMATORS];
+    sfVertex *estimatorDecimated[MAX_ESTIMATORS];
+    size_t estimatorDecimatedCount[MAX_ESTIMATORS];
+    sfText *estimatorLegend[MAX_ESTIMATORS];
     sfText *avgBandwidthText;
     sfText *currentBandwithText;
 
@@ -33,33 +563,141 @@ typedef struct {
     sfText *sizeText;
     sfText *urlText;
     sfText *maxSpeedText;
+    sfText *quantileText;
+    sfText *queueText;
+
+    // Connection phases band, under the X axis
+    sfVertex phaseBand[PHASE_COUNT * 4];
+    size_t phaseBandCount;
+    sfText *phaseText;
+    size_t maxBatchSize; // Biggest number of samples drained in one frame
     sfText *legendAvg;
     sfText *legendCur;
+    sfText *legendDisk;
     sfVertexArray *legendAvgColor;
     sfVertexArray *legendCurColor;
+    sfVertexArray *legendDiskColor;
 
 }   Graphics;
 
+// Command line parameters
 typedef struct {
-    // Application data
+    char *urls[MAX_STREAMS];
+    int urlCount;
+    char *filename; // Destination of the first download, NULL for not writing it
+
+    // Headless mode : no window, samples are written as CSV
+    bool headless;
+    char *csvFilename; // NULL for stdout
+
+    // Seconds between two samples
+    double tickPeriod;
+
+    // Number of byte ranges the URL is split into
+    int segments;
+
+    // Rolling speed estimators
+    EstimatorSpec estimators[MAX_ESTIMATORS];
+    int estimatorCount;
+
+    // Start with a log scale Y axis
+    bool logScale;
+
+    // Upload generated data instead of, or along with, downloading
+    TransferMode mode;
+    size_t uploadSize; // MB
+    bool put; // PUT instead of POST
+
+    // Sample log to write, or to replay instead of downloading
+    char *recordFilename;
+    char *replayFilename;
+    double replaySpeed; // 1 for real time, 0 for as fast as possible
+
+    // Loopback test server
+    int servePort; // Only serve on this port, no download
+    bool local; // Download from a test server started in background
+    char *profile;
+    size_t serveSize; // MB
+} Options;
+
+// One of the parallel downloads
+typedef struct {
+    struct Application *application;
+    int index;
     CURL *curl;
+
+    // Bytes transferred, counted by the CURL callbacks and read by the sampler
+    _Alignas(CACHE_LINE_SIZE) atomic_llong bytes;
+    atomic_llong arrival; // Monotonic time in ns of the last bytes counted
+
+    // TCP state of the connection, read by the CURL thread while it uses the socket
+    _Atomic double tcp[TCP_SERIES_COUNT];
+    atomic_bool tcpValid;
+    int64_t tcpTime; // Monotonic time in ns of the last read, only used by the CURL thread
+    bool attached; // Transfer added to the multi handle, only used by the CURL thread
+    _Atomic double speed; // KB/s over the speed window, published by the sampler
+
+    // Uploading stream, sending generated bytes
+    bool upload;
+    curl_off_t uploaded; // Bytes given to CURL so far
+
+    // Byte range when downloading one URL in segments. The end can be
+    // lowered while downloading when another stream steals the rest.
+    curl_off_t offset; // Next byte to write
+    curl_off_t end; // Last byte of the range
+    bool checked; // The server answered with a partial content
+    int retries; // Times the range was resumed after a failure
+
+    DiskBuffer *staging; // Buffer being filled for the disk writer
+
+    // Current speed estimation, only used by the sampler
+    SpeedWindow speedWindow;
+    double lastSampleTime;
+} Stream;
+
+typedef struct Application {
+    // Application data
+    Options options;
+    CURLM *multi;
+    Stream streams[MAX_STREAMS];
+    int streamCount;
+    bool segmented; // Streams download ranges of the same URL
+    curl_off_t contentLength; // Size of the segmented resource
+    char *uploadData; // UPLOAD_BUFFER_SIZE generated bytes shared by the uploading streams
     sfRenderWindow *window;
     Graphics graphics;
 
     // SFML <-> CURL communication
-    sfMutex *mutex;
-    BbQueue *dataQueue;
+    SampleChannel *dataChannel;
+    Wakeup dataReady;
+    atomic_bool downloadDone;
+    atomic_bool stopRequested; // Set when the window is closed before the end of the transfers
+    bool failed; // A transfer didn't complete, only read once the producer is joined
+
+    // Sampler thread, reading the byte counters at a fixed rate
+    int64_t startTime; // Monotonic time in ns of the start of the transfers
+    atomic_llong firstByte; // Monotonic time in ns of the first byte of any stream, 0 before
+    atomic_bool sampling;
+    PhaseTimeline phases;
+
+    // Samples received by the SFML thread
+    History history;
+    Pyramid pyramid;
+    RangeTree rangeTree;
+    QuantileSketch quantiles;
+
+    // Rolling estimators of the total speed, only used by the sampler
+    Estimator estimators[MAX_ESTIMATORS];
 
     // Destination file
     FILE *output;
-} Application;
+    DiskWriter writer;
+    SpeedWindow diskSpeedWindow; // Only used by the sampler
 
-typedef struct {
-    double time;
-    double speed;
-    double size;
-    double lastSecondSpeed;
-} VertexData;
+    // Sample logs
+    FILE *record;
+    SampleLog replay;
+} Application;
 
 /** === Prototypes === */
 // Initialize SFML window
@@ -68,11 +706,213 @@ bool init_sfml (sfRenderWindow **_window);
 // Initialize CURL library
 bool init_curl (CURL **_curl, char *url);
 
-// CURL progress callback
-int progress_callback (Application *self, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow);
+// Initialize a speed window of a given duration in seconds
+bool speed_window_init (SpeedWindow *self, double duration, size_t capacity);
+
+// Add a new sample to the speed window and drop the expired ones
+void speed_window_push (SpeedWindow *self, double time, double size);
+
+// Get the size downloaded per second over the window
+double speed_window_get_speed (SpeedWindow *self);
+
+// Print the speed window allocation statistics
+void speed_window_print_stats (SpeedWindow *self);
+
+// Free the speed window samples
+void speed_window_free (SpeedWindow *self);
+
+// Initialize a rolling estimator
+bool estimator_init (Estimator *self, EstimatorSpec *spec);
+
+// Add the total size received at a given time and get the estimated speed
+double estimator_push (Estimator *self, double time, double size);
+
+// Get a short name of an estimator, such as "ewma2s"
+void estimator_get_name (EstimatorSpec *spec, char *name, size_t size);
+
+// Allocate an empty sample channel
+SampleChannel *sample_channel_new (void);
+
+// Copy a sample into the channel (producer only). Returns false if the channel is full.
+bool sample_channel_push (SampleChannel *self, VertexData *data);
+
+// Copy up to max pending samples out of the channel (consumer only). Returns the number of samples copied.
+size_t sample_channel_pop_batch (SampleChannel *self, VertexData *data, size_t max);
+
+// Check if there is no sample to consume (consumer only)
+bool sample_channel_is_empty (SampleChannel *self);
+
+// Get the number of samples dropped because the consumer was too slow
+size_t sample_channel_get_dropped (SampleChannel *self);
+
+// Free the sample channel
+void sample_channel_free (SampleChannel *self);
+
+// Create the wakeup event
+bool wakeup_init (Wakeup *self);
+
+// Wake the sleeping thread up, does nothing if it is not sleeping
+void wakeup_signal (Wakeup *self);
+
+// Sleep until signaled or until timeout milliseconds elapsed.
+// hasWork is checked after announcing the sleep so no signal can be missed.
+void wakeup_wait (Wakeup *self, int timeout, bool (*hasWork) (void *), void *arg);
+
+// Get a monotonic time in nanoseconds
+int64_t get_monotonic_time (void);
+
+// Sleep until a monotonic time in nanoseconds
+void sleep_until (int64_t deadline);
+
+// Create a sample log file and write its header
+FILE *sample_log_create (char *filename, char *url, int streamCount, double tickPeriod, EstimatorSpec *estimators, int estimatorCount);
+
+// Append samples to a sample log file
+void sample_log_write (FILE *file, VertexData *data, size_t count);
+
+// Map a sample log file in memory
+bool sample_log_open (SampleLog *self, char *filename);
+
+// Unmap a sample log file
+void sample_log_close (SampleLog *self);
+
+// Parse a throughput profile description
+bool throughput_profile_parse (ThroughputProfile *self, char *spec);
+
+// Get the throughput of a profile in KB/s, time seconds after the start of a response
+double throughput_profile_get_rate (ThroughputProfile *self, double time);
+
+// Listen on 127.0.0.1:port, 0 for any free port
+bool test_server_init (TestServer *self, int port, char *profile, size_t contentSize);
+
+// Accept and serve connections forever
+void *test_server_run (void *self);
+
+// Initialize an empty history
+void history_init (History *self);
+
+// Append a sample to the history, with one value per HistorySeries
+bool history_push (History *self, double time, float *values);
+
+// Get the time of the i-th sample
+double history_get_time (History *self, size_t i);
+
+// Get the value of the i-th sample for a given series
+float history_get_value (History *self, HistorySeries series, size_t i);
+
+// Free the history chunks
+void history_free (History *self);
+
+// Initialize the pyramid levels
+void pyramid_init (Pyramid *self);
+
+// Add a sample to the bucket covering its time, at every level
+bool pyramid_push (Pyramid *self, double time, float *values);
+
+// Get the finest level whose buckets last at least minDuration seconds
+PyramidLevel *pyramid_get_level (Pyramid *self, double minDuration);
+
+// Get the index of the first sample at or after a given time, count if there is none
+size_t history_find (History *self, double time);
+
+// Initialize an empty range tree
+void range_tree_init (RangeTree *self);
+
+// Grow the tree so it can hold the i-th history sample
+bool range_tree_reserve (RangeTree *self, size_t i);
+
+// Add the i-th history sample, with one value per HistorySeries, once reserved
+void range_tree_push (RangeTree *self, size_t i, float *values);
+
+// Aggregate the history samples [first, last[
+void range_tree_query (RangeTree *self, History *history, size_t first, size_t last, PyramidBucket *out);
+
+// Add a speed sample to the whole run and to the rolling window
+void quantile_sketch_push (QuantileSketch *self, double time, double speed);
+
+// Get the quantiles of the whole run, or of the rolling window
+void quantile_sketch_get (QuantileSketch *self, bool rolling, double *values);
+
+// Print the quantiles of the whole run and of the rolling window
+void quantile_sketch_print (QuantileSketch *self);
+
+// Allocate a sliding maximum able to hold capacity samples
+bool sliding_max_init (SlidingMax *self, size_t capacity);
+
+// Add a sample, dropping the older ones it hides
+void sliding_max_push (SlidingMax *self, double time, double value);
+
+// Drop the samples older than a given time
+void sliding_max_expire (SlidingMax *self, double start);
+
+// Get the maximum of the samples, 0 if there is none
+double sliding_max_get (SlidingMax *self);
+
+// Allocate a plot series able to hold capacity points
+bool plot_series_init (PlotSeries *self, size_t capacity);
+
+// Add a point at the end of the series, dropping the oldest one if it is full
+void plot_series_push (PlotSeries *self, sfVertex vertex);
+
+// Drop the oldest point of the series
+void plot_series_shift (PlotSeries *self);
+
+// Move all the vertices of the series to the left
+void plot_series_rebase (PlotSeries *self, float offset);
+
+// Get the contiguous vertices of the series, from the oldest to the newest
+sfVertex *plot_series_get_vertices (PlotSeries *self);
+
+// Keep the first, min, max and last vertex of each pixel column. Returns the number of vertices kept.
+size_t m4_decimate (sfVertex *vertices, size_t count, float start, float scale, sfVertex *out);
+
+// Get the size of a resource with a HEAD request, -1 if unknown
+curl_off_t probe_content_length (char *url);
+
+// Make a stream download a byte range of its URL
+void stream_set_range (Stream *self, curl_off_t start, curl_off_t end);
+
+// Give an idle stream the second half of the range that would finish last. Returns false if nothing is worth splitting.
+bool steal_segment (Application *self, Stream *idle);
+
+// Write at a given position of a file, without moving its cursor
+bool write_at (FILE *file, void *buf, size_t size, curl_off_t offset);
+
+// Reserve the disk space of a file
+bool preallocate_file (FILE *file, curl_off_t length);
+
+// Allocate the staging buffers and start the writer thread
+bool disk_writer_init (DiskWriter *self, FILE *file);
+
+// Stage bytes to write at a given position. Blocks only when all the buffers wait for the disk.
+bool disk_writer_write (DiskWriter *self, DiskBuffer **staging, void *buf, size_t size, curl_off_t offset);
+
+// Hand a partially filled staging buffer to the writer
+void disk_writer_flush (DiskWriter *self, DiskBuffer **staging);
+
+// Write everything left, stop the writer thread and free the buffers
+void disk_writer_close (DiskWriter *self);
+
+// Count bytes transferred by a stream, stamped with their arrival time
+void stream_count_bytes (Stream *self, size_t bytes);
+
+// Publish the TCP state of the connection of a stream, at most once per tick
+void stream_read_tcp_info (Stream *self, int64_t now);
+
+// Read the connection phases of the first stream, once it got its first byte or once it is done
+void read_phases (Application *self, Stream *stream, bool done);
+
+// Read the TCP state of a connection. Returns false if it is not available.
+bool read_tcp_info (long long socket, double *values);
+
+// Read the byte counters of all the streams and push a sample every tick
+void start_sampler (void *_self);
 
 // CURL write callback
-size_t write_callback (void *buf, size_t size, size_t nmemb, Application *p);
+size_t write_callback (void *buf, size_t size, size_t nmemb, Stream *stream);
+
+// CURL read callback, giving the generated bytes to upload
+size_t read_callback (char *buf, size_t size, size_t nmemb, Stream *stream);
 
 // Draw in SFML window
 void render (Application *self);
@@ -80,8 +920,8 @@ void render (Application *self);
 // Get SFML inputs
 bool input (Application *self);
 
-// Update the application state
-void update (Application *self);
+// Update the application state. Returns true if there is something new to render.
+bool update (Application *self);
 
 /** === Implementation === */
 bool init_sfml (sfRenderWindow **_window) {
@@ -124,167 +964,1715 @@ bool init_curl (CURL **_curl, char *url) {
 
     curl_easy_setopt (curl, CURLOPT_URL, url);
     curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, write_callback);
-    curl_easy_setopt (curl, CURLOPT_XFERINFOFUNCTION, progress_callback);
-    curl_easy_setopt (curl, CURLOPT_NOPROGRESS, 0);
+    curl_easy_setopt (curl, CURLOPT_FOLLOWLOCATION, 1L);
 
     *_curl = curl;
     return true;
 }
 
-void get_vertex_x (sfVertex *v, double time, double start) {
-    v->position.x = (time - start) * X_TILE_SIZE;
-}
-
-void get_vertex_y (sfVertex *v, double axisSizeY, double speed, double limitSpeed) {
-    v->position.y = axisSizeY - (speed * axisSizeY / limitSpeed);
-}
-
-// Function helper for computing the new vertex position
-void get_vertex_pos (sfVertex *v, sfVector2f axisSize, double startAxisTime, double time, double speed, double limitSpeed) {
-    get_vertex_x(v, time, startAxisTime);
-    get_vertex_y(v, axisSize.y, speed, limitSpeed);
+bool speed_window_init (SpeedWindow *self, double duration, size_t capacity) {
 
-    // Check if we overflow the X axis
-    if (v->position.x >= axisSize.x) {
-        v->position.x = axisSize.x;
+    // Round the capacity up to a power of 2 so indices can be masked
+    size_t pow2 = 1;
+    while (pow2 < capacity) {
+        pow2 <<= 1;
     }
-}
-
-void update (Application *self) {
 
-    VertexData *data = NULL;
-    Graphics *graphics = &self->graphics;
+    if (!(self->samples = malloc(sizeof(SpeedSample) * pow2))) {
+        error("Cannot allocate speed window.");
+        return false;
+    }
 
-    // Get the queue data if there is a vertex inside it
-    sfMutex_lock(self->mutex);
-    data = bb_queue_pop(self->dataQueue);
-    sfMutex_unlock(self->mutex);
+    self->capacity = pow2;
+    self->head = 0;
+    self->count = 0;
+    self->duration = duration;
+    self->peak = 0;
+    self->recycled = 0;
+    self->grows = 0;
 
-    // There is something in the queue whenever curl ticks
-    if (!data) {
-        return;
-    }
+    return true;
+}
 
-    // Get max Y
-    static double limitSpeed = 1000;
-    size_t avgSize = sfVertexArray_getVertexCount(graphics->averageBandwith);
-    size_t curSize = sfVertexArray_getVertexCount(graphics->currentBandwith);
+void speed_window_push (SpeedWindow *self, double time, double size) {
 
-    // Add padding to a vertex
-    void add_padding (sfVertex *v) {
-        v->position.x += graphics->padding.x;
-        v->position.y += graphics->padding.y;
+    // Drop the samples that went out of the window
+    // Each sample is removed at most once, so this is amortized O(1)
+    while (self->count && self->samples[self->head].time < time - self->duration) {
+        self->head = (self->head + 1) & (self->capacity - 1);
+        self->count--;
+        self->recycled++;
     }
 
-    // Offset all the vertices to a new position
-    void relocate_vertices(double limitSpeed) {
-        for (size_t i = 0; i < avgSize; i++) {
-            sfVertex *v = sfVertexArray_getVertex(graphics->averageBandwith, i);
-            sfVertex *vData = sfVertexArray_getVertex(graphics->averageBandwithData, i);
-            get_vertex_pos(v, graphics->axisSize, graphics->startAxisTime, vData->position.x, vData->position.y, limitSpeed);
-            add_padding(v);
-        }
-        for (size_t i = 0; i < curSize; i++) {
-            sfVertex *v = sfVertexArray_getVertex(graphics->currentBandwith, i);
-            sfVertex *vData = sfVertexArray_getVertex(graphics->currentBandwithData, i);
-            get_vertex_pos(v, graphics->axisSize, graphics->startAxisTime, vData->position.x, vData->position.y, limitSpeed);
-            add_padding(v);
+    // Grow the ring buffer if it is full, unwrapping it at the same time
+    if (self->count == self->capacity) {
+        SpeedSample *samples = malloc(sizeof(SpeedSample) * self->capacity * 2);
+        if (!samples) {
+            // Keep the window going by forgetting the oldest sample
+            self->head = (self->head + 1) & (self->capacity - 1);
+            self->count--;
+            self->recycled++;
+        } else {
+            size_t tail = self->capacity - self->head;
+            memcpy(samples, &self->samples[self->head], sizeof(SpeedSample) * tail);
+            memcpy(&samples[tail], self->samples, sizeof(SpeedSample) * self->head);
+            free(self->samples);
+            self->samples = samples;
+            self->capacity *= 2;
+            self->head = 0;
+            self->grows++;
         }
     }
 
-    // Check if we need to relocate vertices
-    if (data->speed >= limitSpeed) {
-        limitSpeed = data->speed;
-        relocate_vertices(limitSpeed);
+    SpeedSample *sample = &self->samples[(self->head + self->count) & (self->capacity - 1)];
+    sample->time = time;
+    sample->size = size;
+    self->count++;
+
+    if (self->count > self->peak) {
+        self->peak = self->count;
     }
-    if (data->lastSecondSpeed >= limitSpeed) {
-        limitSpeed = data->lastSecondSpeed;
-        relocate_vertices(limitSpeed);
+}
+
+double speed_window_get_speed (SpeedWindow *self) {
+
+    if (self->count < 2) {
+        return 0.0;
     }
 
-    // Get current vertices position
-    sfVertex averageBpVx, currentBpVx;
-    get_vertex_pos (&averageBpVx, graphics->axisSize, graphics->startAxisTime, data->time, data->speed, limitSpeed);
-    get_vertex_pos (&currentBpVx, graphics->axisSize, graphics->startAxisTime, data->time, data->lastSecondSpeed, limitSpeed);
+    // Sizes are cumulative (prefix sums of the bytes received) : the bytes
+    // received over the window are the difference between the newest and
+    // the oldest sample still inside it
+    SpeedSample *first = &self->samples[self->head];
+    SpeedSample *last = &self->samples[(self->head + self->count - 1) & (self->capacity - 1)];
 
-    if (averageBpVx.position.x >= graphics->axisSize.x) {
+    return (last->size - first->size) / self->duration;
+}
 
-        // Offset all the previous vertices
-        void offset_vertices (
-            sfVertexArray **_band,
-            sfVertexArray **_bandData,
-            sfVertexArray *curB,
-            sfVertexArray *curBData
-        ) {
-            sfVertexArray *band = sfVertexArray_create();
-            sfVertexArray *bandData = sfVertexArray_create();
-            sfVertexArray_setPrimitiveType(band, sfLinesStrip);
+void speed_window_print_stats (SpeedWindow *self) {
+    info("Speed window samples : %zu live, %zu peak, %zu recycled, %zu slots after %zu reallocations.",
+        self->count, self->peak, self->recycled, self->capacity, self->grows);
+}
 
-            for (size_t i = 1; i < avgSize; i++) {
-                sfVertex *v = sfVertexArray_getVertex(curB, i);
-                sfVertex *vData = sfVertexArray_getVertex(curBData, i);
-                if (i == 1) {
-                    graphics->startAxisTime = vData->position.x;
-                }
-                sfVertexArray_append(band, *v);
-                sfVertexArray_append(bandData, *vData);
-            }
+void speed_window_free (SpeedWindow *self) {
+    free(self->samples);
+    self->samples = NULL;
+    self->capacity = 0;
+    self->count = 0;
+}
 
-            *_band = band;
-            *_bandData = bandData;
-        }
+bool estimator_init (Estimator *self, EstimatorSpec *spec) {
 
-        sfVertexArray *avgBand = NULL;
-        sfVertexArray *avgBandData = NULL;
-        sfVertexArray *curBand = NULL;
-        sfVertexArray *curBandData = NULL;
+    memset(self, 0, sizeof(*self));
+    self->spec = *spec;
 
-        offset_vertices(&avgBand, &avgBandData, graphics->averageBandwith, graphics->averageBandwithData);
-        offset_vertices(&curBand, &curBandData, graphics->currentBandwith, graphics->currentBandwithData);
+    if (spec->type == ESTIMATOR_WINDOW) {
+        return speed_window_init(&self->window, spec->duration, SPEED_WINDOW_CAPACITY);
+    }
+    return true;
+}
 
-        sfVertexArray_destroy(graphics->averageBandwith);
-        sfVertexArray_destroy(graphics->averageBandwithData);
-        sfVertexArray_destroy(graphics->currentBandwith);
-        sfVertexArray_destroy(graphics->currentBandwithData);
+double estimator_push (Estimator *self, double time, double size) {
 
-        graphics->averageBandwith = avgBand;
-        graphics->averageBandwithData = avgBandData;
-        graphics->currentBandwith = curBand;
-        graphics->currentBandwithData = curBandData;
+    if (self->spec.type == ESTIMATOR_WINDOW) {
+        speed_window_push(&self->window, time, size);
+        return speed_window_get_speed(&self->window);
+    }
 
-        relocate_vertices(limitSpeed);
+    // Blend the speed since the last sample in, with a weight depending on the time elapsed
+    double elapsed = time - self->lastTime;
+    if (elapsed > 0) {
+        double speed = (size - self->lastSize) / elapsed;
+        double alpha = 1 - exp2(-elapsed / self->spec.duration);
+        self->speed += alpha * (speed - self->speed);
+        self->lastTime = time;
+        self->lastSize = size;
     }
+    return self->speed;
+}
 
-    // Apply padding
-    add_padding(&averageBpVx);
-    add_padding(&currentBpVx);
+void estimator_get_name (EstimatorSpec *spec, char *name, size_t size) {
+    snprintf(name, size, "%s%gs", (spec->type == ESTIMATOR_WINDOW) ? "window" : "ewma", spec->duration);
+}
 
-    // Apply color
-    averageBpVx.color = sfRed;
-    currentBpVx.color = sfYellow;
+SampleChannel *sample_channel_new (void) {
 
-    sfVertex averageBpVxData = {.position = {.x = data->time, .y = data->speed}};
-    sfVertex currentBpVxData = {.position = {.x = data->time, .y = data->lastSecondSpeed}};
+    SampleChannel *self;
 
-    // Add them to the vertices array
-    sfVertexArray_append (graphics->averageBandwith, averageBpVx);
-    sfVertexArray_append (graphics->averageBandwithData, averageBpVxData);
-    sfVertexArray_append (graphics->currentBandwith, currentBpVx);
-    sfVertexArray_append (graphics->currentBandwithData, currentBpVxData);
+    // The channel is over-aligned, allocate it by hand and keep the original pointer just before it
+    void *block = malloc(sizeof(SampleChannel) + CACHE_LINE_SIZE + sizeof(void *));
+    if (!block) {
+        error("Cannot allocate sample channel.");
+        return NULL;
+    }
 
-    // Update text string and position
-    char string[100];
-    sprintf(string, "%.0f KB/s", data->speed);
+    uintptr_t aligned = ((uintptr_t) block + sizeof(void *) + CACHE_LINE_SIZE - 1) & ~((uintptr_t) CACHE_LINE_SIZE - 1);
+    self = (SampleChannel *) aligned;
+    ((void **) self)[-1] = block;
+
+    atomic_init(&self->head, 0);
+    atomic_init(&self->tail, 0);
+    atomic_init(&self->dropped, 0);
+    self->cachedHead = 0;
+    self->cachedTail = 0;
+
+    return self;
+}
+
+bool sample_channel_push (SampleChannel *self, VertexData *data) {
+
+    size_t tail = atomic_load_explicit(&self->tail, memory_order_relaxed);
+
+    // Only reload the consumer index when the ring looks full
+    if (tail - self->cachedHead >= SAMPLE_CHANNEL_CAPACITY) {
+        self->cachedHead = atomic_load_explicit(&self->head, memory_order_acquire);
+        if (tail - self->cachedHead >= SAMPLE_CHANNEL_CAPACITY) {
+            // Never block the CURL thread, just account for the lost sample
+            atomic_fetch_add_explicit(&self->dropped, 1, memory_order_relaxed);
+            return false;
+        }
+    }
+
+    self->samples[tail & (SAMPLE_CHANNEL_CAPACITY - 1)] = *data;
+    atomic_store_explicit(&self->tail, tail + 1, memory_order_release);
+
+    return true;
+}
+
+size_t sample_channel_pop_batch (SampleChannel *self, VertexData *data, size_t max) {
+
+    size_t head = atomic_load_explicit(&self->head, memory_order_relaxed);
+
+    // Take everything the producer published so far, in one go
+    self->cachedTail = atomic_load_explicit(&self->tail, memory_order_acquire);
+    size_t count = self->cachedTail - head;
+    if (count > max) {
+        count = max;
+    }
+
+    // Copy the samples in at most two contiguous chunks
+    size_t start = head & (SAMPLE_CHANNEL_CAPACITY - 1);
+    size_t first = SAMPLE_CHANNEL_CAPACITY - start;
+    if (first > count) {
+        first = count;
+    }
+    memcpy(data, &self->samples[start], sizeof(VertexData) * first);
+    memcpy(&data[first], self->samples, sizeof(VertexData) * (count - first));
+
+    atomic_store_explicit(&self->head, head + count, memory_order_release);
+
+    return count;
+}
+
+bool sample_channel_is_empty (SampleChannel *self) {
+    size_t head = atomic_load_explicit(&self->head, memory_order_relaxed);
+
+    // Samples are known to be left without touching the producer cache line
+    if (head != self->cachedTail) {
+        return false;
+    }
+    self->cachedTail = atomic_load_explicit(&self->tail, memory_order_acquire);
+    return head == self->cachedTail;
+}
+
+size_t sample_channel_get_dropped (SampleChannel *self) {
+    return atomic_load_explicit(&self->dropped, memory_order_relaxed);
+}
+
+void sample_channel_free (SampleChannel *self) {
+    if (self) {
+        free(((void **) self)[-1]);
+    }
+}
+
+bool wakeup_init (Wakeup *self) {
+
+    atomic_init(&self->waiting, false);
+
+#ifdef _WIN32
+    // Auto-reset event
+    if (!(self->event = CreateEvent(NULL, FALSE, FALSE, NULL))) {
+        error("Cannot create wakeup event.");
+        return false;
+    }
+#else
+    if ((self->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        error("Cannot create wakeup eventfd.");
+        return false;
+    }
+#endif
+
+    return true;
+}
+
+void wakeup_signal (Wakeup *self) {
+
+    // Skip the system call as long as the other thread is awake
+    if (!atomic_exchange(&self->waiting, false)) {
+        return;
+    }
+
+#ifdef _WIN32
+    SetEvent(self->event);
+#else
+    uint64_t one = 1;
+    if (write(self->fd, &one, sizeof(one)) != sizeof(one)) {
+        // Counter saturated : a wakeup is already pending
+    }
+#endif
+}
+
+void wakeup_wait (Wakeup *self, int timeout, bool (*hasWork) (void *), void *arg) {
+
+    atomic_store(&self->waiting, true);
+
+    if (!hasWork(arg)) {
+#ifdef _WIN32
+        WaitForSingleObject(self->event, timeout);
+#else
+        struct pollfd pfd = {.fd = self->fd, .events = POLLIN};
+        if (poll(&pfd, 1, timeout) > 0) {
+            uint64_t count;
+            if (read(self->fd, &count, sizeof(count)) != sizeof(count)) {
+                // Already consumed
+            }
+        }
+#endif
+    }
+
+    atomic_store(&self->waiting, false);
+}
+
+int64_t get_monotonic_time (void) {
+#ifdef _WIN32
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    if (!frequency.QuadPart) {
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&counter);
+    return (int64_t) (counter.QuadPart / frequency.QuadPart) * 1000000000
+         + (int64_t) (counter.QuadPart % frequency.QuadPart) * 1000000000 / frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+void sleep_until (int64_t deadline) {
+#ifdef _WIN32
+    int64_t delay = deadline - get_monotonic_time();
+    if (delay > 0) {
+        Sleep(delay / 1000000);
+    }
+    // Spin the last fraction of millisecond the timer cannot wait for
+    while (get_monotonic_time() < deadline) {
+        YieldProcessor();
+    }
+#else
+    // An absolute deadline doesn't drift with the time spent sampling
+    struct timespec time = {.tv_sec = deadline / 1000000000, .tv_nsec = deadline % 1000000000};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &time, NULL) == EINTR);
+#endif
+}
+
+FILE *sample_log_create (char *filename, char *url, int streamCount, double tickPeriod, EstimatorSpec *estimators, int estimatorCount) {
+
+    FILE *file;
+    if (!(file = fopen(filename, "wb"))) {
+        error("Cannot open '%s'.", filename);
+        return NULL;
+    }
+
+    SampleLogHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SAMPLE_LOG_MAGIC, sizeof(header.magic));
+    header.version = SAMPLE_LOG_VERSION;
+    header.recordSize = sizeof(VertexData);
+    header.streamCount = streamCount;
+    header.estimatorCount = estimatorCount;
+    memcpy(header.estimators, estimators, sizeof(EstimatorSpec) * estimatorCount);
+    strncpy(header.units, "KB", sizeof(header.units) - 1);
+    header.startEpoch = time(NULL);
+    header.tickPeriod = tickPeriod;
+    strncpy(header.url, url, sizeof(header.url) - 1);
+
+    if (fwrite(&header, sizeof(header), 1, file) != 1) {
+        error("Cannot write '%s' header.", filename);
+        fclose(file);
+        return NULL;
+    }
+
+    return file;
+}
+
+void sample_log_write (FILE *file, VertexData *data, size_t count) {
+    if (fwrite(data, sizeof(VertexData), count, file) != count) {
+        error("Cannot write %zu samples to the sample log.", count);
+    }
+}
+
+bool sample_log_open (SampleLog *self, char *filename) {
+
+    memset(self, 0, sizeof(*self));
+
+#ifdef _WIN32
+    LARGE_INTEGER size;
+    self->file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (self->file == INVALID_HANDLE_VALUE || !GetFileSizeEx(self->file, &size)) {
+        error("Cannot open '%s'.", filename);
+        return false;
+    }
+    self->size = size.QuadPart;
+    if (self->size < sizeof(SampleLogHeader)
+    || !(self->mapping = CreateFileMappingA(self->file, NULL, PAGE_READONLY, 0, 0, NULL))
+    || !(self->base = MapViewOfFile(self->mapping, FILE_MAP_READ, 0, 0, 0))) {
+        error("Cannot map '%s'.", filename);
+        return false;
+    }
+#else
+    struct stat st;
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        error("Cannot open '%s'.", filename);
+        return false;
+    }
+    self->size = st.st_size;
+    self->base = (self->size >= sizeof(SampleLogHeader))
+        ? mmap(NULL, self->size, PROT_READ, MAP_PRIVATE, fd, 0)
+        : MAP_FAILED;
+    close(fd);
+    if (self->base == MAP_FAILED) {
+        self->base = NULL;
+        error("Cannot map '%s'.", filename);
+        return false;
+    }
+    // Records are read once from the start to the end
+    madvise(self->base, self->size, MADV_SEQUENTIAL);
+#endif
+
+    self->header = self->base;
+    if (memcmp(self->header->magic, SAMPLE_LOG_MAGIC, sizeof(self->header->magic))
+    ||  self->header->version != SAMPLE_LOG_VERSION
+    ||  self->header->recordSize != sizeof(VertexData)
+    ||  self->header->streamCount < 1 || self->header->streamCount > MAX_STREAMS) {
+        error("'%s' is not a sample log.", filename);
+        sample_log_close(self);
+        return false;
+    }
+    if (!memchr(self->header->url, '\0', sizeof(self->header->url))) {
+        error("'%s' has an invalid URL.", filename);
+        sample_log_close(self);
+        return false;
+    }
+
+    // The tick and the estimators durations size the curves buffers : reject zero, negative and NaN
+    bool valid = self->header->tickPeriod > 0 && self->header->estimatorCount <= MAX_ESTIMATORS;
+    for (uint32_t i = 0; valid && i < self->header->estimatorCount; i++) {
+        valid = self->header->estimators[i].duration > 0
+            && (self->header->estimators[i].type == ESTIMATOR_WINDOW || self->header->estimators[i].type == ESTIMATOR_EWMA);
+    }
+    if (!valid) {
+        error("'%s' has an invalid tick period or estimator.", filename);
+        sample_log_close(self);
+        return false;
+    }
+
+    self->records = (VertexData *) ((char *) self->base + sizeof(SampleLogHeader));
+    self->count = (self->size - sizeof(SampleLogHeader)) / sizeof(VertexData);
+
+    return true;
+}
+
+void sample_log_close (SampleLog *self) {
+#ifdef _WIN32
+    if (self->base) {
+        UnmapViewOfFile(self->base);
+    }
+    if (self->mapping) {
+        CloseHandle(self->mapping);
+    }
+    if (self->file && self->file != INVALID_HANDLE_VALUE) {
+        CloseHandle(self->file);
+    }
+#else
+    if (self->base) {
+        munmap(self->base, self->size);
+    }
+#endif
+    memset(self, 0, sizeof(*self));
+}
+
+bool throughput_profile_parse (ThroughputProfile *self, char *spec) {
+
+    memset(self, 0, sizeof(*self));
+    double a = 0, b = 0, c = 0;
+
+    if (sscanf(spec, "constant:%lf", &a) == 1) {
+        self->type = PROFILE_CONSTANT;
+        self->rate = a;
+    } else if (sscanf(spec, "step:%lf:%lf:%lf", &a, &b, &c) == 3) {
+        self->type = PROFILE_STEP;
+        self->rate = a;
+        self->rate2 = b;
+        self->period = c;
+    } else if (sscanf(spec, "sawtooth:%lf:%lf", &a, &b) == 2) {
+        self->type = PROFILE_SAWTOOTH;
+        self->rate = a;
+        self->period = b;
+    } else if (sscanf(spec, "bucket:%lf:%lf", &a, &b) == 2) {
+        self->type = PROFILE_TOKEN_BUCKET;
+        self->rate = a;
+        self->burst = b;
+    } else if (sscanf(spec, "stall:%lf:%lf:%lf", &a, &b, &c) == 3) {
+        self->type = PROFILE_STALL;
+        self->rate = a;
+        self->period = b;
+        self->pause = c;
+    } else if (!strncmp(spec, "replay:", strlen("replay:"))) {
+        self->type = PROFILE_REPLAY;
+        if (!sample_log_open(&self->trace, spec + strlen("replay:")) || !self->trace.count) {
+            error("Cannot replay '%s'.", spec + strlen("replay:"));
+            return false;
+        }
+    } else {
+        error("Unknown throughput profile '%s'.", spec);
+        return false;
+    }
+
+    if ((self->type == PROFILE_STEP || self->type == PROFILE_SAWTOOTH || self->type == PROFILE_STALL)
+    &&  self->period <= 0) {
+        error("Throughput profile '%s' needs a positive period.", spec);
+        return false;
+    }
+
+    return true;
+}
+
+double throughput_profile_get_rate (ThroughputProfile *self, double time) {
+
+    switch (self->type) {
+        case PROFILE_CONSTANT:
+        case PROFILE_TOKEN_BUCKET:
+            return self->rate;
+
+        case PROFILE_STEP:
+            return ((long) (time / self->period) % 2) ? self->rate2 : self->rate;
+
+        case PROFILE_SAWTOOTH:
+            return self->rate * fmod(time, self->period) / self->period;
+
+        case PROFILE_STALL:
+            return (fmod(time, self->period + self->pause) < self->period) ? self->rate : 0;
+
+        case PROFILE_REPLAY: {
+            // Loop over the trace, taking the last sample before this time
+            VertexData *records = self->trace.records;
+            size_t count = self->trace.count;
+            double duration = records[count - 1].time;
+            double t = (duration > 0) ? fmod(time, duration) : 0;
+            size_t low = 0, high = count;
+            while (high - low > 1) {
+                size_t middle = (low + high) / 2;
+                if (records[middle].time <= t) {
+                    low = middle;
+                } else {
+                    high = middle;
+                }
+            }
+            return records[low].lastSecondSpeed;
+        }
+    }
+
+    return 0;
+}
+
+#ifndef _WIN32
+bool test_server_init (TestServer *self, int port, char *profile, size_t contentSize) {
+
+    memset(self, 0, sizeof(*self));
+    self->contentLength = contentSize * 1024 * 1024;
+
+    if (!throughput_profile_parse(&self->profile, profile)) {
+        return false;
+    }
+
+    // Clients closing the connection must not kill the process
+    signal(SIGPIPE, SIG_IGN);
+
+    // Generated bytes, sent in loop straight from the page cache
+    FILE *data = tmpfile();
+    if (!data) {
+        error("Cannot create test server data.");
+        return false;
+    }
+    char *chunk = malloc(TEST_SERVER_CHUNK_SIZE);
+    if (!chunk) {
+        error("Cannot allocate test server data.");
+        fclose(data);
+        return false;
+    }
+    for (size_t i = 0; i < TEST_SERVER_CHUNK_SIZE; i++) {
+        chunk[i] = i * 31 + 7;
+    }
+    bool written = true;
+    for (size_t i = 0; written && i < TEST_SERVER_DATA_SIZE; i += TEST_SERVER_CHUNK_SIZE) {
+        written = fwrite(chunk, TEST_SERVER_CHUNK_SIZE, 1, data) == 1;
+    }
+    free(chunk);
+    if (!written || fflush(data)) {
+        error("Cannot write test server data.");
+        fclose(data);
+        return false;
+    }
+    self->dataFd = dup(fileno(data));
+    fclose(data);
+
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+    };
+    socklen_t length = sizeof(address);
+    int yes = 1;
+
+    if ((self->listenFd = socket(AF_INET, SOCK_STREAM, 0)) == -1
+    ||  setsockopt(self->listenFd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1
+    ||  bind(self->listenFd, (struct sockaddr *) &address, sizeof(address)) == -1
+    ||  listen(self->listenFd, 16) == -1
+    ||  getsockname(self->listenFd, (struct sockaddr *) &address, &length) == -1) {
+        error("Cannot listen on port %d.", port);
+        return false;
+    }
+    self->port = ntohs(address.sin_port);
+
+    return true;
+}
+
+typedef struct {
+    TestServer *server;
+    int fd;
+} TestServerClient;
+
+// Credit of bytes earned over time at the rate of a throughput profile
+typedef struct {
+    ThroughputProfile *profile;
+    struct timespec start;
+    double lastTime;
+    double credit;
+} TestServerPacer;
+
+void test_server_pacer_init (TestServerPacer *self, ThroughputProfile *profile) {
+
+    clock_gettime(CLOCK_MONOTONIC, &self->start);
+    self->profile = profile;
+    self->lastTime = 0;
+    self->credit = (profile->type == PROFILE_TOKEN_BUCKET) ? profile->burst * 1024 : 0;
+}
+
+// Get how many bytes can be transferred now, up to max. Sleeps and returns 0 until at least one
+// quantum, the bytes of one slice, is earned, so the connections don't spin on tiny transfers.
+size_t test_server_pacer_get_allowance (TestServerPacer *self, size_t max) {
+
+    ThroughputProfile *profile = self->profile;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double time = (now.tv_sec - self->start.tv_sec) + (now.tv_nsec - self->start.tv_nsec) / 1e9;
+    double rate = throughput_profile_get_rate(profile, time) * 1024;
+
+    // Earn the bytes allowed since the last transfer, without saving too many of them
+    double maxCredit = (profile->type == PROFILE_TOKEN_BUCKET)
+        ? profile->burst * 1024
+        : rate * TEST_SERVER_SLICE / 1000.0 * 2 + 1;
+    self->credit += rate * (time - self->lastTime);
+    if (self->credit > maxCredit) {
+        self->credit = maxCredit;
+    }
+    self->lastTime = time;
+
+    double quantum = fmin(fmin(rate * TEST_SERVER_SLICE / 1000.0, TEST_SERVER_CHUNK_SIZE), fmin(maxCredit, max));
+    if (quantum < 1) {
+        quantum = 1;
+    }
+
+    // Sleep until the quantum is earned, one slice at most so the profile changes are followed
+    if (self->credit < quantum) {
+        double wait = (rate > 0) ? (quantum - self->credit) / rate : TEST_SERVER_SLICE / 1000.0;
+        if (wait > TEST_SERVER_SLICE / 1000.0) {
+            wait = TEST_SERVER_SLICE / 1000.0;
+        }
+        struct timespec slice = {.tv_sec = 0, .tv_nsec = wait * 1e9 + 1};
+        nanosleep(&slice, NULL);
+        return 0;
+    }
+
+    size_t size = (self->credit < TEST_SERVER_CHUNK_SIZE) ? self->credit : TEST_SERVER_CHUNK_SIZE;
+    return (size > max) ? max : size;
+}
+
+// Answer one request, throttled by the server profile
+void *test_server_serve (void *_client) {
+
+    TestServerClient *client = _client;
+    TestServer *server = client->server;
+    int fd = client->fd;
+    free(client);
+
+    // Read the request headers
+    char request[4096];
+    size_t received = 0;
+    ssize_t n;
+    char *body = NULL;
+    request[0] = '\0';
+    while (received < sizeof(request) - 1 && (n = recv(fd, request + received, sizeof(request) - 1 - received, 0)) > 0) {
+        received += n;
+        request[received] = '\0';
+        if ((body = strstr(request, "\r\n\r\n"))) {
+            body += 4;
+            break;
+        }
+    }
+
+    // Closed or too long before the end of the headers
+    if (!body) {
+        close(fd);
+        return NULL;
+    }
+
+    TestServerPacer pacer;
+    test_server_pacer_init(&pacer, &server->profile);
+
+    // Receive and drop an uploaded body at the profile rate
+    size_t bodyLength;
+    char *contentLength = strstr(request, "Content-Length: ");
+    if (body && contentLength && sscanf(contentLength, "Content-Length: %zu", &bodyLength) == 1) {
+        static const char continueHeader[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        if (strstr(request, "Expect: 100-continue")
+        &&  send(fd, continueHeader, sizeof(continueHeader) - 1, 0) != sizeof(continueHeader) - 1) {
+            close(fd);
+            return NULL;
+        }
+
+        char *scratch = malloc(TEST_SERVER_CHUNK_SIZE);
+        size_t bodyReceived = request + received - body;
+        while (scratch && bodyReceived < bodyLength) {
+            size_t size = test_server_pacer_get_allowance(&pacer, bodyLength - bodyReceived);
+            if (!size) {
+                continue;
+            }
+            if ((n = recv(fd, scratch, size, 0)) <= 0) {
+                break;
+            }
+            bodyReceived += n;
+            pacer.credit -= n;
+        }
+        free(scratch);
+
+        static const char answer[] =
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Length: 0\r\n"
+            "Connection: close\r\n\r\n";
+        send(fd, answer, sizeof(answer) - 1, 0);
+        close(fd);
+        return NULL;
+    }
+
+    // Answer "Range: bytes=first-last" requests with a partial content
+    size_t first = 0, length = server->contentLength;
+    unsigned long long rangeFirst, rangeLast;
+    char *range = strstr(request, "Range: bytes=");
+    bool partial = range && sscanf(range, "Range: bytes=%llu-%llu", &rangeFirst, &rangeLast) == 2
+        && rangeFirst <= rangeLast && rangeLast < server->contentLength;
+    if (partial) {
+        first = rangeFirst;
+        length = rangeLast - rangeFirst + 1;
+    }
+
+    char header[512];
+    int headerSize = (partial)
+        ? sprintf(header,
+            "HTTP/1.1 206 Partial Content\r\n"
+            "Content-Type: application/octet-stream\r\n"
+            "Content-Range: bytes %zu-%zu/%zu\r\n"
+            "Content-Length: %zu\r\n"
+            "Connection: close\r\n\r\n", first, first + length - 1, server->contentLength, length)
+        : sprintf(header,
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Type: application/octet-stream\r\n"
+            "Accept-Ranges: bytes\r\n"
+            "Content-Length: %zu\r\n"
+            "Connection: close\r\n\r\n", length);
+
+    if (send(fd, header, headerSize, 0) != headerSize || !strncmp(request, "HEAD ", 5)) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t sent = 0;
+    while (sent < length) {
+        size_t size = test_server_pacer_get_allowance(&pacer, length - sent);
+        if (!size) {
+            continue;
+        }
+
+        // Zero copy from the generated file, wrapping at its end
+        off_t offset = (first + sent) % TEST_SERVER_DATA_SIZE;
+        if (size > TEST_SERVER_DATA_SIZE - offset) {
+            size = TEST_SERVER_DATA_SIZE - offset;
+        }
+        if ((n = sendfile(fd, server->dataFd, &offset, size)) <= 0) {
+            break;
+        }
+        sent += n;
+        pacer.credit -= n;
+    }
+
+    close(fd);
+    return NULL;
+}
+
+void *test_server_run (void *_self) {
+
+    TestServer *self = _self;
+
+    while (true) {
+        int fd = accept(self->listenFd, NULL, NULL);
+        if (fd == -1) {
+            // Persistent errors like EMFILE would spin the loop
+            if (errno != EINTR && errno != ECONNABORTED) {
+                poll(NULL, 0, TEST_SERVER_ACCEPT_BACKOFF);
+            }
+            continue;
+        }
+
+        // One thread per connection, so several downloads can be throttled independently
+        TestServerClient *client = malloc(sizeof(TestServerClient));
+        if (!client) {
+            error("Cannot allocate test server client.");
+            close(fd);
+            poll(NULL, 0, TEST_SERVER_ACCEPT_BACKOFF);
+            continue;
+        }
+        client->server = self;
+        client->fd = fd;
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, test_server_serve, client)) {
+            close(fd);
+            free(client);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    return NULL;
+}
+#else
+bool test_server_init (TestServer *self, int port, char *profile, size_t contentSize) {
+    error("The test server is only available on Linux.");
+    return false;
+}
+
+void *test_server_run (void *self) {
+    return NULL;
+}
+#endif
+
+void history_init (History *self) {
+    self->chunks = NULL;
+    self->chunksCapacity = 0;
+    self->count = 0;
+}
+
+bool history_push (History *self, double time, float *values) {
+
+    size_t chunkIndex = self->count / HISTORY_CHUNK_SIZE;
+    size_t index = self->count % HISTORY_CHUNK_SIZE;
+
+    if (index == 0) {
+        // Only the chunk pointers are reallocated, the samples never move
+        if (chunkIndex == self->chunksCapacity) {
+            size_t capacity = (self->chunksCapacity) ? self->chunksCapacity * 2 : 16;
+            HistoryChunk **chunks = realloc(self->chunks, sizeof(HistoryChunk *) * capacity);
+            if (!chunks) {
+                error("Cannot grow history to %zu chunks.", capacity);
+                return false;
+            }
+            self->chunks = chunks;
+            self->chunksCapacity = capacity;
+        }
+
+        if (!(self->chunks[chunkIndex] = malloc(sizeof(HistoryChunk)))) {
+            error("Cannot allocate history chunk.");
+            return false;
+        }
+    }
+
+    HistoryChunk *chunk = self->chunks[chunkIndex];
+    chunk->time[index] = time;
+    for (int series = 0; series < HISTORY_SERIES_COUNT; series++) {
+        chunk->values[series][index] = values[series];
+    }
+    self->count++;
+
+    return true;
+}
+
+double history_get_time (History *self, size_t i) {
+    return self->chunks[i / HISTORY_CHUNK_SIZE]->time[i % HISTORY_CHUNK_SIZE];
+}
+
+float history_get_value (History *self, HistorySeries series, size_t i) {
+    return self->chunks[i / HISTORY_CHUNK_SIZE]->values[series][i % HISTORY_CHUNK_SIZE];
+}
+
+void history_free (History *self) {
+    for (size_t i = 0; i < self->chunksCapacity && i * HISTORY_CHUNK_SIZE < self->count; i++) {
+        free(self->chunks[i]);
+    }
+    free(self->chunks);
+    history_init(self);
+}
+
+static void pyramid_bucket_add (PyramidBucket *self, float *values) {
+    for (int series = 0; series < HISTORY_SERIES_COUNT; series++) {
+        if (!self->count || values[series] < self->min[series]) {
+            self->min[series] = values[series];
+        }
+        if (!self->count || values[series] > self->max[series]) {
+            self->max[series] = values[series];
+        }
+        self->sum[series] += values[series];
+    }
+    self->count++;
+}
+
+static void pyramid_bucket_merge (PyramidBucket *self, PyramidBucket *other) {
+    if (!other->count) {
+        return;
+    }
+    if (!self->count) {
+        *self = *other;
+        return;
+    }
+    for (int series = 0; series < HISTORY_SERIES_COUNT; series++) {
+        self->min[series] = fminf(self->min[series], other->min[series]);
+        self->max[series] = fmaxf(self->max[series], other->max[series]);
+        self->sum[series] += other->sum[series];
+    }
+    self->count += other->count;
+}
+
+void pyramid_init (Pyramid *self) {
+    for (int i = 0; i < PYRAMID_LEVEL_COUNT; i++) {
+        PyramidLevel *level = &self->levels[i];
+        level->duration = pyramidLevelDurations[i];
+        level->buckets = NULL;
+        level->count = 0;
+        level->capacity = 0;
+    }
+}
+
+bool pyramid_push (Pyramid *self, double time, float *values) {
+
+    for (int i = 0; i < PYRAMID_LEVEL_COUNT; i++) {
+        PyramidLevel *level = &self->levels[i];
+        size_t index = time / level->duration;
+
+        if (index >= level->capacity) {
+            size_t capacity = (level->capacity) ? level->capacity : 64;
+            while (capacity <= index) {
+                capacity *= 2;
+            }
+            PyramidBucket *buckets = realloc(level->buckets, sizeof(PyramidBucket) * capacity);
+            if (!buckets) {
+                error("Cannot grow pyramid level to %zu buckets.", capacity);
+                return false;
+            }
+            level->buckets = buckets;
+            level->capacity = capacity;
+        }
+
+        // Open the buckets up to this one, leaving empty ones where no sample came
+        while (level->count <= index) {
+            memset(&level->buckets[level->count++], 0, sizeof(PyramidBucket));
+        }
+
+        pyramid_bucket_add(&level->buckets[index], values);
+    }
+
+    return true;
+}
+
+PyramidLevel *pyramid_get_level (Pyramid *self, double minDuration) {
+    for (int i = 0; i < PYRAMID_LEVEL_COUNT; i++) {
+        if (self->levels[i].duration >= minDuration) {
+            return &self->levels[i];
+        }
+    }
+    return &self->levels[PYRAMID_LEVEL_COUNT - 1];
+}
+
+size_t history_find (History *self, double time) {
+    size_t low = 0;
+    size_t high = self->count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (history_get_time(self, middle) < time) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+void range_tree_init (RangeTree *self) {
+    self->nodes = NULL;
+    self->leafCapacity = 0;
+}
+
+bool range_tree_reserve (RangeTree *self, size_t i) {
+
+    size_t leaf = i / RANGE_TREE_BLOCK;
+
+    if (leaf >= self->leafCapacity) {
+        // Move the leaves to a tree twice as wide and rebuild the nodes above them
+        size_t capacity = (self->leafCapacity) ? self->leafCapacity * 2 : 64;
+        PyramidBucket *nodes = calloc(capacity * 2, sizeof(PyramidBucket));
+        if (!nodes) {
+            error("Cannot grow range tree to %zu leaves.", capacity);
+            return false;
+        }
+        if (self->leafCapacity) {
+            memcpy(&nodes[capacity], &self->nodes[self->leafCapacity], sizeof(PyramidBucket) * self->leafCapacity);
+        }
+        for (size_t node = capacity - 1; node >= 1; node--) {
+            pyramid_bucket_merge(&nodes[node], &nodes[node * 2]);
+            pyramid_bucket_merge(&nodes[node], &nodes[node * 2 + 1]);
+        }
+        free(self->nodes);
+        self->nodes = nodes;
+        self->leafCapacity = capacity;
+    }
+
+    return true;
+}
+
+void range_tree_push (RangeTree *self, size_t i, float *values) {
+
+    size_t leaf = i / RANGE_TREE_BLOCK;
+
+    // The history only grows, so the sample can be added to every node above its leaf
+    for (size_t node = self->leafCapacity + leaf; node >= 1; node /= 2) {
+        pyramid_bucket_add(&self->nodes[node], values);
+    }
+}
+
+void range_tree_query (RangeTree *self, History *history, size_t first, size_t last, PyramidBucket *out) {
+
+    memset(out, 0, sizeof(PyramidBucket));
+
+    void add_samples (size_t from, size_t to) {
+        for (size_t i = from; i < to; i++) {
+            float values[HISTORY_SERIES_COUNT];
+            for (int series = 0; series < HISTORY_SERIES_COUNT; series++) {
+                values[series] = history_get_value(history, series, i);
+            }
+            pyramid_bucket_add(out, values);
+        }
+    }
+
+    // Whole blocks come from the tree, the samples around them from the history
+    size_t firstLeaf = (first + RANGE_TREE_BLOCK - 1) / RANGE_TREE_BLOCK;
+    size_t lastLeaf = last / RANGE_TREE_BLOCK;
+    if (firstLeaf >= lastLeaf) {
+        add_samples(first, last);
+        return;
+    }
+    add_samples(first, firstLeaf * RANGE_TREE_BLOCK);
+    add_samples(lastLeaf * RANGE_TREE_BLOCK, last);
+
+    for (size_t left = firstLeaf + self->leafCapacity, right = lastLeaf + self->leafCapacity; left < right; left /= 2, right /= 2) {
+        if (left & 1) {
+            pyramid_bucket_merge(out, &self->nodes[left++]);
+        }
+        if (right & 1) {
+            pyramid_bucket_merge(out, &self->nodes[--right]);
+        }
+    }
+}
+
+static int histogram_get_bucket (double speed) {
+
+    if (speed < QUANTILE_MIN_SPEED) {
+        return 0;
+    }
+
+    // Exponent and mantissa in [0.5, 1[ of speed / QUANTILE_MIN_SPEED
+    int exponent;
+    double mantissa = frexp(speed / QUANTILE_MIN_SPEED, &exponent);
+    if (exponent > QUANTILE_DOUBLINGS) {
+        return QUANTILE_BUCKET_COUNT - 1;
+    }
+    return 1 + (exponent - 1) * QUANTILE_SUB_BUCKETS + (int) ((mantissa - 0.5) * 2 * QUANTILE_SUB_BUCKETS);
+}
+
+static double histogram_get_speed (int bucket) {
+
+    if (!bucket) {
+        return 0;
+    }
+
+    // Middle of the bucket
+    int exponent = (bucket - 1) / QUANTILE_SUB_BUCKETS;
+    double mantissa = 1 + ((bucket - 1) % QUANTILE_SUB_BUCKETS + 0.5) / QUANTILE_SUB_BUCKETS;
+    return ldexp(mantissa * QUANTILE_MIN_SPEED, exponent);
+}
+
+// Find all the quantiles in one pass over the buckets
+static void histogram_get_quantiles (Histogram *self, double *values) {
+
+    int q = 0;
+    uint64_t seen = 0;
+    for (int bucket = 0; bucket < QUANTILE_BUCKET_COUNT && q < QUANTILE_COUNT; bucket++) {
+        seen += self->counts[bucket];
+        while (q < QUANTILE_COUNT && seen && seen >= quantiles[q] * self->total) {
+            values[q++] = histogram_get_speed(bucket);
+        }
+    }
+    while (q < QUANTILE_COUNT) {
+        values[q++] = 0;
+    }
+}
+
+void quantile_sketch_push (QuantileSketch *self, double time, double speed) {
+
+    // Recycle the slices that went out of the window, at most all of them
+    long long slice = time / (QUANTILE_WINDOW_DURATION / QUANTILE_WINDOW_SLICES);
+    if (slice > self->slice) {
+        long long first = (slice - self->slice > QUANTILE_WINDOW_SLICES) ? slice - QUANTILE_WINDOW_SLICES + 1 : self->slice + 1;
+        for (long long i = first; i <= slice; i++) {
+            memset(&self->slices[i % QUANTILE_WINDOW_SLICES], 0, sizeof(Histogram));
+        }
+        self->slice = slice;
+    }
+
+    int bucket = histogram_get_bucket(speed);
+    Histogram *current = &self->slices[self->slice % QUANTILE_WINDOW_SLICES];
+    self->run.counts[bucket]++;
+    self->run.total++;
+    current->counts[bucket]++;
+    current->total++;
+}
+
+void quantile_sketch_get (QuantileSketch *self, bool rolling, double *values) {
+
+    if (!rolling) {
+        histogram_get_quantiles(&self->run, values);
+        return;
+    }
+
+    // Merge the slices of the window
+    static Histogram window;
+    memset(&window, 0, sizeof(window));
+    for (int i = 0; i < QUANTILE_WINDOW_SLICES; i++) {
+        Histogram *slice = &self->slices[i];
+        if (!slice->total) {
+            continue;
+        }
+        for (int bucket = 0; bucket < QUANTILE_BUCKET_COUNT; bucket++) {
+            window.counts[bucket] += slice->counts[bucket];
+        }
+        window.total += slice->total;
+    }
+    histogram_get_quantiles(&window, values);
+}
+
+void quantile_sketch_print (QuantileSketch *self) {
+
+    double run[QUANTILE_COUNT], window[QUANTILE_COUNT];
+    quantile_sketch_get(self, false, run);
+    quantile_sketch_get(self, true, window);
+
+    info("Speed percentiles (KB/s) over the run : p1 %.0f, p5 %.0f, p50 %.0f, p95 %.0f, p99 %.0f.",
+        run[0], run[1], run[2], run[3], run[4]);
+    info("Speed percentiles (KB/s) over the last %.0f seconds : p1 %.0f, p5 %.0f, p50 %.0f, p95 %.0f, p99 %.0f.",
+        QUANTILE_WINDOW_DURATION, window[0], window[1], window[2], window[3], window[4]);
+}
+
+bool sliding_max_init (SlidingMax *self, size_t capacity) {
+
+    size_t pow2 = 1;
+    while (pow2 < capacity) {
+        pow2 <<= 1;
+    }
+
+    if (!(self->samples = malloc(sizeof(MaxSample) * pow2))) {
+        error("Cannot allocate sliding maximum.");
+        return false;
+    }
+
+    self->capacity = pow2;
+    self->head = 0;
+    self->count = 0;
+    return true;
+}
+
+void sliding_max_push (SlidingMax *self, double time, double value) {
+
+    // A sample lower than the new one can't be the maximum anymore
+    while (self->count && self->samples[(self->head + self->count - 1) & (self->capacity - 1)].value <= value) {
+        self->count--;
+    }
+
+    // Only when more samples are pushed than visible : forget the oldest one
+    if (self->count == self->capacity) {
+        self->head = (self->head + 1) & (self->capacity - 1);
+        self->count--;
+    }
+
+    self->samples[(self->head + self->count) & (self->capacity - 1)] = (MaxSample) {.time = time, .value = value};
+    self->count++;
+}
+
+void sliding_max_expire (SlidingMax *self, double start) {
+    while (self->count && self->samples[self->head].time < start) {
+        self->head = (self->head + 1) & (self->capacity - 1);
+        self->count--;
+    }
+}
+
+double sliding_max_get (SlidingMax *self) {
+    return (self->count) ? self->samples[self->head].value : 0;
+}
+
+bool plot_series_init (PlotSeries *self, size_t capacity) {
+
+    self->vertices = malloc(sizeof(sfVertex) * capacity * 2);
+
+    if (!self->vertices) {
+        error("Cannot allocate plot series of %zu points.", capacity);
+        return false;
+    }
+
+    self->capacity = capacity;
+    self->head = 0;
+    self->count = 0;
+
+    return true;
+}
+
+void plot_series_push (PlotSeries *self, sfVertex vertex) {
+
+    if (self->count == self->capacity) {
+        plot_series_shift(self);
+    }
+
+    size_t index = (self->head + self->count) % self->capacity;
+    self->vertices[index] = vertex;
+    self->vertices[index + self->capacity] = vertex;
+    self->count++;
+}
+
+void plot_series_shift (PlotSeries *self) {
+
+    if (!self->count) {
+        return;
+    }
+
+    self->head = (self->head + 1) % self->capacity;
+    self->count--;
+}
+
+void plot_series_rebase (PlotSeries *self, float offset) {
+    for (size_t i = 0; i < self->count; i++) {
+        size_t index = (self->head + i) % self->capacity;
+        self->vertices[index].position.x -= offset;
+        self->vertices[index + self->capacity] = self->vertices[index];
+    }
+}
+
+sfVertex *plot_series_get_vertices (PlotSeries *self) {
+    return &self->vertices[self->head];
+}
+
+size_t m4_decimate (sfVertex *vertices, size_t count, float start, float scale, sfVertex *out) {
+
+    size_t outCount = 0;
+    size_t i = 0;
+
+    while (i < count) {
+        long column = floorf((vertices[i].position.x - start) * scale);
+        size_t first = i, min = i, max = i, last = i;
+
+        for (i++; i < count && (long) floorf((vertices[i].position.x - start) * scale) == column; i++) {
+            if (vertices[i].position.y < vertices[min].position.y) {
+                min = i;
+            }
+            if (vertices[i].position.y > vertices[max].position.y) {
+                max = i;
+            }
+            last = i;
+        }
+
+        // Emit them in time order : the line strip then goes through the same pixels as the full one
+        size_t kept[4] = {
+            first,
+            (min < max) ? min : max,
+            (min < max) ? max : min,
+            last
+        };
+        for (int k = 0; k < 4; k++) {
+            if (k == 0 || kept[k] != kept[k - 1]) {
+                out[outCount++] = vertices[kept[k]];
+            }
+        }
+    }
+
+    return outCount;
+}
+
+// Get the Y of a speed before the transforms, which is its logarithm with the log scale
+double get_axis_value (Graphics *graphics, double speed) {
+    return (graphics->logScale) ? log10(fmax(speed, 1)) : speed;
+}
+
+// Function helper for placing series vertices, stored as (time - timeOrigin, value), on screen
+// with a given value at the top of the Y axis
+sfTransform get_series_transform (Graphics *graphics, double limit) {
+
+    double scaleY = graphics->axisSize.y / limit;
+
+    return sfTransform_fromMatrix (
+        X_TILE_SIZE, 0, graphics->padding.x - (graphics->startAxisTime - graphics->timeOrigin) * X_TILE_SIZE,
+        0, -scaleY, graphics->padding.y + graphics->axisSize.y,
+        0, 0, 1
+    );
+}
+
+// Function helper for placing the curves vertices, stored as (time - timeOrigin, speed), on screen
+sfTransform get_curve_transform (Graphics *graphics) {
+    return get_series_transform (graphics, get_axis_value (graphics, graphics->limitSpeed));
+}
+
+// Function helper for placing vertices with X in curve space and Y in screen space
+sfTransform get_band_transform (Graphics *graphics) {
+
+    return sfTransform_fromMatrix (
+        X_TILE_SIZE, 0, graphics->padding.x - (graphics->startAxisTime - graphics->timeOrigin) * X_TILE_SIZE,
+        0, 1, 0,
+        0, 0, 1
+    );
+}
+
+// Function helper for placing the overview vertices, stored as (time - overviewStart, speed), on screen
+sfTransform get_overview_transform (Graphics *graphics) {
+
+    double scaleY = graphics->axisSize.y / get_axis_value (graphics, graphics->overviewLimit);
+
+    return sfTransform_fromMatrix (
+        graphics->axisSize.x / graphics->viewSpan, 0, graphics->padding.x,
+        0, -scaleY, graphics->padding.y + graphics->axisSize.y,
+        0, 0, 1
+    );
+}
+
+// Rebuild the overview vertices, about one min / max pair per pixel column : from the samples when
+// there are few of them, from the pyramid when its buckets are wider than a pixel, from the range tree otherwise
+void update_overview (Application *self) {
+
+    Graphics *graphics = &self->graphics;
+    History *history = &self->history;
+    graphics->overviewDirty = false;
+    graphics->overviewCount = 0;
+
+    if (!history->count) {
+        return;
+    }
+
+    // Follow the newest sample again once panned back to it
+    double end = history_get_time(history, history->count - 1);
+    double latest = (end > graphics->viewSpan) ? end - graphics->viewSpan : 0;
+    if (graphics->followLatest || graphics->overviewStart >= latest) {
+        graphics->overviewStart = latest;
+        graphics->followLatest = true;
+    } else if (graphics->overviewStart < 0) {
+        graphics->overviewStart = 0;
+    }
+    double start = graphics->overviewStart;
+    size_t first = history_find(history, start);
+    size_t last = history_find(history, start + graphics->viewSpan);
+    double columnDuration = graphics->viewSpan / graphics->axisSize.x;
+
+    // At most two vertices per pixel column, or per bucket of the coarsest pyramid level
+    size_t needed = 2 * ((size_t) graphics->axisSize.x + graphics->viewSpan / pyramidLevelDurations[PYRAMID_LEVEL_COUNT - 1] + 2);
+    if (needed > graphics->overviewCapacity) {
+        for (int series = 0; series < HISTORY_SERIES_COUNT; series++) {
+            sfVertex *vertices = realloc(graphics->overview[series], sizeof(sfVertex) * needed);
+            if (!vertices) {
+                error("Cannot allocate %zu overview vertices.", needed);
+                return;
+            }
+            graphics->overview[series] = vertices;
+        }
+        graphics->overviewCapacity = needed;
+    }
+
+    sfColor colors[HISTORY_SERIES_COUNT] = {
+        [HISTORY_AVERAGE] = sfRed,
+        [HISTORY_CURRENT] = sfYellow,
+        [HISTORY_DISK] = sfGreen
+    };
+
+    // Zigzag between the min and max of each bucket so the strip covers the whole range
+    double max = 0;
+    void add_bucket (PyramidBucket *bucket, float x) {
+        for (int series = 0; series < HISTORY_SERIES_COUNT; series++) {
+            if ((series != HISTORY_DISK || graphics->diskCurve) && bucket->max[series] > max) {
+                max = bucket->max[series];
+            }
+            sfVertex *v = &graphics->overview[series][graphics->overviewCount];
+            v[0] = (sfVertex) {.position = {.x = x, .y = bucket->min[series]}, .color = colors[series]};
+            v[1] = (sfVertex) {.position = {.x = x, .y = bucket->max[series]}, .color = colors[series]};
+        }
+        graphics->overviewCount += 2;
+    }
+
+    if (last - first <= (size_t) graphics->axisSize.x) {
+        // Few samples : draw them all
+        for (size_t i = first; i < last; i++) {
+            PyramidBucket sample = {.count = 1};
+            for (int series = 0; series < HISTORY_SERIES_COUNT; series++) {
+                sample.min[series] = sample.max[series] = history_get_value(history, series, i);
+            }
+            add_bucket(&sample, history_get_time(history, i) - start);
+        }
+    } else if (columnDuration >= pyramidLevelDurations[0]) {
+        PyramidLevel *level = pyramid_get_level(&self->pyramid, columnDuration);
+        size_t lastBucket = fmin(ceil((start + graphics->viewSpan) / level->duration), level->count);
+        for (size_t i = start / level->duration; i < lastBucket; i++) {
+            if (level->buckets[i].count) {
+                add_bucket(&level->buckets[i], (i + 0.5) * level->duration - start);
+            }
+        }
+    } else {
+        // Pixel columns shorter than the finest buckets : aggregate the samples of each column
+        size_t i = first;
+        for (size_t column = 0; column < (size_t) graphics->axisSize.x && i < last; column++) {
+            size_t next = history_find(history, start + (column + 1) * columnDuration);
+            if (next > i) {
+                PyramidBucket bucket;
+                range_tree_query(&self->rangeTree, history, i, next, &bucket);
+                add_bucket(&bucket, (column + 0.5) * columnDuration);
+                i = next;
+            }
+        }
+    }
+    graphics->overviewLimit = fmax(max * AUTOSCALE_HEADROOM, AUTOSCALE_MIN);
+
+    // Aggregates of the current speed over the X axis
+    char string[200] = "";
+    if (last > first) {
+        PyramidBucket range;
+        range_tree_query(&self->rangeTree, history, first, last, &range);
+        snprintf(string, sizeof(string), "%.0f - %.0f s : %zu samples, current speed min %.0f / mean %.0f / max %.0f KB/s",
+            start, start + graphics->viewSpan, range.count,
+            range.min[HISTORY_CURRENT], range.sum[HISTORY_CURRENT] / range.count, range.max[HISTORY_CURRENT]);
+    }
+    sfText_setString(graphics->rangeText, string);
+}
+
+// Place the crosshair on the sample nearest to the mouse X, hidden outside of the axis
+void update_crosshair (Application *self) {
+
+    Graphics *graphics = &self->graphics;
+    History *history = &self->history;
+    float axisX = graphics->mouse.x - graphics->padding.x;
+    graphics->crosshairShown = false;
+
+    if (!history->count || axisX < 0 || axisX > graphics->axisSize.x
+    ||  graphics->mouse.y < graphics->padding.y || graphics->mouse.y > graphics->padding.y + graphics->axisSize.y) {
+        return;
+    }
+
+    // Screen X <-> time, for the view shown
+    double start = (graphics->viewSpan) ? graphics->overviewStart : graphics->startAxisTime;
+    double scaleX = (graphics->viewSpan) ? graphics->axisSize.x / graphics->viewSpan : X_TILE_SIZE;
+    double time = start + axisX / scaleX;
+
+    size_t i = history_find(history, time);
+    if (i == history->count || (i > 0 && time - history_get_time(history, i - 1) < history_get_time(history, i) - time)) {
+        i--;
+    }
+    double sampleTime = history_get_time(history, i);
+    float current = history_get_value(history, HISTORY_CURRENT, i);
+    float average = history_get_value(history, HISTORY_AVERAGE, i);
+    if (sampleTime < start || sampleTime > start + graphics->axisSize.x / scaleX) {
+        return;
+    }
+
+    double limit = (graphics->viewSpan) ? graphics->overviewLimit : graphics->limitSpeed;
+    float x = graphics->padding.x + (sampleTime - start) * scaleX;
+    float y = graphics->padding.y + graphics->axisSize.y
+            - fmin(get_axis_value(graphics, current) / get_axis_value(graphics, limit), 1) * graphics->axisSize.y;
+    sfColor color = sfColor_fromRGBA(255, 255, 255, 128);
+    graphics->crosshair[0] = (sfVertex) {.position = {x, graphics->padding.y}, .color = color};
+    graphics->crosshair[1] = (sfVertex) {.position = {x, graphics->padding.y + graphics->axisSize.y}, .color = color};
+    graphics->crosshair[2] = (sfVertex) {.position = {graphics->padding.x, y}, .color = color};
+    graphics->crosshair[3] = (sfVertex) {.position = {graphics->padding.x + graphics->axisSize.x, y}, .color = color};
+    graphics->crosshairShown = true;
+
+    char string[100];
+    snprintf(string, sizeof(string), "%.2f s : %.0f KB/s (average %.0f KB/s)", sampleTime, current, average);
+    sfText_setString(graphics->crosshairText, string);
+    sfText_setPosition(graphics->crosshairText, (sfVector2f) {.x = x + 5, .y = y - 20});
+}
+
+// Rebuild the connection phases band and its text
+void update_phases (Application *self, double now) {
+
+    Graphics *graphics = &self->graphics;
+    PhaseTimeline *timeline = &self->phases;
+    graphics->phaseBandCount = 0;
+
+    if (!atomic_load(&timeline->ready)) {
+        return;
+    }
+
+    double end = atomic_load(&timeline->end);
+    double bounds[PHASE_COUNT + 1];
+    bounds[0] = timeline->start;
+    for (int phase = 0; phase < PHASE_TRANSFER; phase++) {
+        bounds[phase + 1] = timeline->ends[phase];
+    }
+    bounds[PHASE_COUNT] = (end) ? end : now;
+
+    // Clip the phases scrolled out of the X axis
+    float left = graphics->startAxisTime - graphics->timeOrigin;
+    float top = graphics->padding.y + graphics->axisSize.y + 3;
+    for (int phase = 0; phase < PHASE_COUNT; phase++) {
+        float x0 = fmax(bounds[phase] - graphics->timeOrigin, left);
+        float x1 = fmax(bounds[phase + 1] - graphics->timeOrigin, left);
+        if (x1 <= x0) {
+            continue;
+        }
+        sfColor color = sfColor_fromRGB(phaseColors[phase][0], phaseColors[phase][1], phaseColors[phase][2]);
+        sfVertex *quad = &graphics->phaseBand[graphics->phaseBandCount];
+        quad[0] = (sfVertex) {.position = {x0, top}, .color = color};
+        quad[1] = (sfVertex) {.position = {x1, top}, .color = color};
+        quad[2] = (sfVertex) {.position = {x1, top + PHASE_BAND_HEIGHT}, .color = color};
+        quad[3] = (sfVertex) {.position = {x0, top + PHASE_BAND_HEIGHT}, .color = color};
+        graphics->phaseBandCount += 4;
+    }
+
+    char string[200];
+    size_t length = 0;
+    for (int phase = 0; phase < PHASE_TRANSFER; phase++) {
+        length += snprintf(string + length, sizeof(string) - length, "%s%s %.0f ms",
+            (phase) ? "  " : "", phaseNames[phase], (bounds[phase + 1] - bounds[phase]) * 1000);
+    }
+    sfText_setString(graphics->phaseText, string);
+}
+
+// Rescale the Y axis only when the highest visible point gets out of the axis or too low in it.
+// The vertices are in data space, so this only changes the render transform.
+void update_limit_speed (Graphics *graphics) {
+    double highest = sliding_max_get(&graphics->visibleMax);
+    if (highest > graphics->limitSpeed
+    ||  get_axis_value(graphics, highest) < get_axis_value(graphics, graphics->limitSpeed) * AUTOSCALE_SHRINK) {
+        graphics->limitSpeed = fmax(highest * AUTOSCALE_HEADROOM, AUTOSCALE_MIN);
+    }
+}
+
+// Refill the visible maximum from the live series, when the curves it covers change
+void rebuild_visible_max (Graphics *graphics) {
+
+    graphics->visibleMax.head = 0;
+    graphics->visibleMax.count = 0;
+
+    // Every live series gets one vertex per sample, so they share their indices
+    sfVertex *average = plot_series_get_vertices(&graphics->averageBandwith);
+    sfVertex *current = plot_series_get_vertices(&graphics->currentBandwith);
+    sfVertex *disk = plot_series_get_vertices(&graphics->diskBandwith);
+    for (size_t i = 0; i < graphics->averageBandwith.count; i++) {
+        double highest = fmax(fmax(average[i].position.y, current[i].position.y), (graphics->diskCurve) ? disk[i].position.y : 0);
+        for (int estimator = 0; estimator < graphics->estimatorCount; estimator++) {
+            if (graphics->estimatorShown[estimator]) {
+                highest = fmax(highest, plot_series_get_vertices(&graphics->estimatorSeries[estimator])[i].position.y);
+            }
+        }
+        sliding_max_push(&graphics->visibleMax, graphics->timeOrigin + average[i].position.x, highest);
+    }
+
+    update_limit_speed(graphics);
+}
+
+bool update (Application *self) {
+
+    static VertexData batch[SAMPLE_CHANNEL_CAPACITY];
+    Graphics *graphics = &self->graphics;
+
+    // Drain every sample produced since the last frame
+    size_t batchSize = sample_channel_pop_batch(self->dataChannel, batch, SAMPLE_CHANNEL_CAPACITY);
+
+    if (self->record && batchSize) {
+        sample_log_write(self->record, batch, batchSize);
+    }
+
+    // There is something in the channel whenever curl ticks
+    if (!batchSize) {
+        if (graphics->overviewDirty) {
+            update_overview(self);
+            return true;
+        }
+        return false;
+    }
+
+    // Keep the vertices X small : floats lose precision after a few hours of download
+    if (graphics->startAxisTime - graphics->timeOrigin >= TIME_ORIGIN_REBASE_PERIOD) {
+        float offset = graphics->startAxisTime - graphics->timeOrigin;
+        plot_series_rebase(&graphics->averageBandwith, offset);
+        plot_series_rebase(&graphics->currentBandwith, offset);
+        plot_series_rebase(&graphics->diskBandwith, offset);
+        for (int series = 0; series < TCP_SERIES_COUNT; series++) {
+            plot_series_rebase(&graphics->tcpSeries[series], offset);
+        }
+        for (int i = 0; i < graphics->estimatorCount; i++) {
+            plot_series_rebase(&graphics->estimatorSeries[i], offset);
+        }
+        for (int i = 0; i < graphics->streamCount; i++) {
+            plot_series_rebase(&graphics->streamBandwith[i], offset);
+        }
+        graphics->timeOrigin = graphics->startAxisTime;
+        graphics->plotDirty = true;
+    }
+
+    for (size_t n = 0; n < batchSize; n++) {
+        VertexData *data = &batch[n];
+
+        // Scroll : drop the oldest points until the new one fits on the X axis.
+        // Only the ring head and the axis start move, the vertices stay in place.
+        while ((data->time - graphics->startAxisTime) * X_TILE_SIZE >= graphics->axisSize.x) {
+            plot_series_shift(&graphics->averageBandwith);
+            plot_series_shift(&graphics->currentBandwith);
+            plot_series_shift(&graphics->diskBandwith);
+            for (int series = 0; series < TCP_SERIES_COUNT; series++) {
+                plot_series_shift(&graphics->tcpSeries[series]);
+            }
+            for (int i = 0; i < graphics->estimatorCount; i++) {
+                plot_series_shift(&graphics->estimatorSeries[i]);
+            }
+            for (int i = 0; i < graphics->streamCount; i++) {
+                plot_series_shift(&graphics->streamBandwith[i]);
+            }
+            graphics->startAxisTime = (graphics->averageBandwith.count)
+                ? history_get_time(&self->history, self->history.count - graphics->averageBandwith.count)
+                : data->time;
+        }
+        sliding_max_expire(&graphics->visibleMax, graphics->startAxisTime);
+
+        // Keep the full precision sample in the history
+        float values[HISTORY_SERIES_COUNT] = {
+            [HISTORY_AVERAGE] = data->speed,
+            [HISTORY_CURRENT] = data->lastSecondSpeed,
+            [HISTORY_DISK] = data->diskSpeed
+        };
+        // The range tree is grown first : its queries need every history sample in it
+        size_t index = self->history.count;
+        if (!range_tree_reserve(&self->rangeTree, index) || !history_push(&self->history, data->time, values)) {
+            continue;
+        }
+        pyramid_push(&self->pyramid, data->time, values);
+        range_tree_push(&self->rangeTree, index, values);
+
+        // Percentiles of the current speed, once the transfer started
+        if (data->size > 0) {
+            quantile_sketch_push(&self->quantiles, data->time, data->lastSecondSpeed);
+        }
+
+        float x = data->time - graphics->timeOrigin;
+        sfVertex averageBpVx = {.position = {.x = x, .y = data->speed}, .color = sfRed};
+        sfVertex currentBpVx = {.position = {.x = x, .y = data->lastSecondSpeed}, .color = sfYellow};
+
+        // Add them to the series
+        plot_series_push (&graphics->averageBandwith, averageBpVx);
+        plot_series_push (&graphics->currentBandwith, currentBpVx);
+        plot_series_push (&graphics->diskBandwith, (sfVertex) {.position = {.x = x, .y = data->diskSpeed}, .color = sfGreen});
+
+        // Highest point of the sample among the curves shown
+        double highest = fmax(fmax(data->speed, data->lastSecondSpeed), (graphics->diskCurve) ? data->diskSpeed : 0);
+        for (int i = 0; i < graphics->estimatorCount; i++) {
+            if (graphics->estimatorShown[i]) {
+                highest = fmax(highest, data->estimates[i]);
+            }
+        }
+        sliding_max_push(&graphics->visibleMax, data->time, highest);
+
+        // Estimators are always kept, so toggling one shows its past too
+        for (int i = 0; i < graphics->estimatorCount; i++) {
+            const sfUint8 *color = estimatorColors[i];
+            plot_series_push (&graphics->estimatorSeries[i], (sfVertex) {
+                .position = {.x = x, .y = data->estimates[i]},
+                .color = sfColor_fromRGB(color[0], color[1], color[2])
+            });
+        }
+
+        // Each TCP series is scaled on its own maximum
+        for (int series = 0; series < TCP_SERIES_COUNT; series++) {
+            const sfUint8 *color = tcpColors[series];
+            if (data->tcp[series] > graphics->tcpLimit[series]) {
+                graphics->tcpLimit[series] = data->tcp[series];
+                graphics->plotDirty = true;
+            }
+            plot_series_push (&graphics->tcpSeries[series], (sfVertex) {
+                .position = {.x = x, .y = data->tcp[series]},
+                .color = sfColor_fromRGBA(color[0], color[1], color[2], color[3])
+            });
+        }
+
+        // Stack the streams : the last one ends on the current speed
+        double stacked = 0;
+        for (int i = 0; i < graphics->streamCount; i++) {
+            stacked += data->streamSpeed[i];
+            sfColor color = sfColor_fromRGB(streamColors[i][0], streamColors[i][1], streamColors[i][2]);
+            plot_series_push (&graphics->streamBandwith[i], (sfVertex) {.position = {.x = x, .y = stacked}, .color = color});
+        }
+        graphics->plotPending++;
+    }
+
+    // Rescale the Y axis once for the whole batch
+    update_limit_speed(graphics);
+
+    // Texts only depend on the newest sample of the batch
+    VertexData *data = &batch[batchSize - 1];
+    sfTransform transform;
+    float x;
+    if (graphics->viewSpan) {
+        update_overview(self);
+        transform = get_overview_transform(graphics);
+        x = data->time - graphics->overviewStart;
+    } else {
+        transform = get_curve_transform(graphics);
+        x = data->time - graphics->timeOrigin;
+    }
+    sfVector2f averageBpPos = sfTransform_transformPoint(&transform, (sfVector2f) {x, get_axis_value(graphics, data->speed)});
+    sfVector2f currentBpPos = sfTransform_transformPoint(&transform, (sfVector2f) {x, get_axis_value(graphics, data->lastSecondSpeed)});
+
+    // Update text string and position
+    char string[100];
+    sprintf(string, "%.0f KB/s", data->speed);
     sfText_setPosition(graphics->avgBandwidthText, (sfVector2f){
-        .x = averageBpVx.position.x + 15,
-        .y = averageBpVx.position.y - 15
+        .x = averageBpPos.x + 15,
+        .y = averageBpPos.y - 15
     });
     sfText_setString(graphics->avgBandwidthText, string);
 
     sprintf(string, "%.0f KB/s", data->lastSecondSpeed);
     sfText_setPosition(graphics->currentBandwithText, (sfVector2f){
-        .x = currentBpVx.position.x + 15,
-        .y = currentBpVx.position.y - 15
+        .x = currentBpPos.x + 15,
+        .y = currentBpPos.y - 15
     });
     sfText_setString(graphics->currentBandwithText, string);
 
@@ -297,78 +2685,752 @@ void update (Application *self) {
     sfText_setString(graphics->sizeText, string);
 
     // Update max speed text
-    sprintf(string, "%.0f KB/s", limitSpeed);
+    sprintf(string, "%.0f KB/s%s", (graphics->viewSpan) ? graphics->overviewLimit : graphics->limitSpeed,
+        (graphics->logScale) ? " (log)" : "");
     sfText_setString(graphics->maxSpeedText, string);
+
+    // Update connection phases
+    update_phases(self, data->time);
+
+    // Update percentiles text
+    double run[QUANTILE_COUNT], window[QUANTILE_COUNT];
+    quantile_sketch_get(&self->quantiles, false, run);
+    quantile_sketch_get(&self->quantiles, true, window);
+    char quantileString[200];
+    sprintf(quantileString, "Run p1/5/50/95/99 : %.0f / %.0f / %.0f / %.0f / %.0f\n"
+                            "Last %.0fs : %.0f / %.0f / %.0f / %.0f / %.0f",
+        run[0], run[1], run[2], run[3], run[4],
+        QUANTILE_WINDOW_DURATION, window[0], window[1], window[2], window[3], window[4]);
+    sfText_setString(graphics->quantileText, quantileString);
+
+    // Update TCP state texts
+    for (int series = 0; series < TCP_SERIES_COUNT; series++) {
+        sprintf(string, tcpSeriesFormats[series], data->tcp[series]);
+        sfText_setString(graphics->tcpLegend[series], string);
+    }
+
+    // Update queue text
+    if (batchSize > graphics->maxBatchSize) {
+        graphics->maxBatchSize = batchSize;
+    }
+    sprintf(string, "Queue : %zu (max %zu, dropped %zu)",
+        batchSize, graphics->maxBatchSize, sample_channel_get_dropped(self->dataChannel));
+    sfText_setString(graphics->queueText, string);
+
+    return true;
 }
 
-int progress_callback (Application *self, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
+void stream_count_bytes (Stream *self, size_t bytes) {
 
-    static BbQueue lastSecondQueue = bb_queue_local_decl();
-    static BbQueue clearQueue = bb_queue_local_decl();
-    static float lastTime = 0.0;
+    // Only the CURL thread writes the counters, the sampler reads the time before the bytes
+    atomic_fetch_add_explicit(&self->bytes, bytes, memory_order_relaxed);
+    int64_t now = get_monotonic_time();
+    atomic_store_explicit(&self->arrival, now, memory_order_release);
 
-    // Get current time
-    double time;
-    curl_easy_getinfo(self->curl, CURLINFO_TOTAL_TIME, &time);
+    // The average speed is measured from the first byte, without the setup phases
+    if (!atomic_load_explicit(&self->application->firstByte, memory_order_relaxed)) {
+        atomic_store(&self->application->firstByte, now);
+    }
+
+    stream_read_tcp_info(self, now);
+}
+
+void stream_read_tcp_info (Stream *self, int64_t now) {
+
+    // Only called from the CURL thread while the transfer is attached : curl may close the
+    // socket once it is removed from the multi handle, and the descriptor be reused right after
+    int64_t period = self->application->options.tickPeriod * 1e9;
+    if (now - self->tcpTime >= period) {
+        curl_socket_t socket;
+        double values[TCP_SERIES_COUNT];
+        self->tcpTime = now;
+        if (curl_easy_getinfo(self->curl, CURLINFO_ACTIVESOCKET, &socket) == CURLE_OK && socket != CURL_SOCKET_BAD
+        &&  read_tcp_info(socket, values)) {
+            for (int series = 0; series < TCP_SERIES_COUNT; series++) {
+                atomic_store_explicit(&self->tcp[series], values[series], memory_order_relaxed);
+            }
+            atomic_store_explicit(&self->tcpValid, true, memory_order_release);
+        }
+    }
+}
+
+void read_phases (Application *self, Stream *stream, bool done) {
+
+    PhaseTimeline *timeline = &self->phases;
+    if (stream->index != 0) {
+        return;
+    }
+
+    if (!atomic_load(&timeline->ready)) {
+        curl_off_t dns = 0, connect = 0, tls = 0, firstByte = 0;
+        curl_easy_getinfo(stream->curl, CURLINFO_NAMELOOKUP_TIME_T, &dns);
+        curl_easy_getinfo(stream->curl, CURLINFO_CONNECT_TIME_T, &connect);
+        curl_easy_getinfo(stream->curl, CURLINFO_APPCONNECT_TIME_T, &tls);
+        curl_easy_getinfo(stream->curl, CURLINFO_STARTTRANSFER_TIME_T, &firstByte);
+
+        // Uploads only get an answer at their end
+        if (!firstByte && !done) {
+            return;
+        }
+
+        // Counters are in microseconds since the start of the transfer, 0 for skipped phases
+        timeline->ends[PHASE_DNS] = timeline->start + dns / 1e6;
+        timeline->ends[PHASE_CONNECT] = timeline->start + ((connect) ? connect : dns) / 1e6;
+        timeline->ends[PHASE_TLS] = timeline->start + ((tls) ? tls : (connect) ? connect : dns) / 1e6;
+        timeline->ends[PHASE_FIRST_BYTE] = timeline->start + firstByte / 1e6;
+        atomic_store(&timeline->ready, true);
+    }
+
+    if (done && !atomic_load(&timeline->end)) {
+        curl_off_t total = 0;
+        curl_easy_getinfo(stream->curl, CURLINFO_TOTAL_TIME_T, &total);
+        atomic_store(&timeline->end, timeline->start + total / 1e6);
+    }
+}
+
+bool read_tcp_info (long long socket, double *values) {
+#ifdef _WIN32
+    return false;
+#else
+    struct tcp_info info;
+    socklen_t size = sizeof(info);
+    if (getsockopt(socket, IPPROTO_TCP, TCP_INFO, &info, &size)) {
+        return false;
+    }
+
+    values[TCP_RTT] = info.tcpi_rtt / 1000.0;
+    values[TCP_CWND] = info.tcpi_snd_cwnd;
+    values[TCP_RETRANSMITS] = info.tcpi_total_retrans;
+    values[TCP_RCV_SPACE] = info.tcpi_rcv_space / 1024.0;
+    return true;
+#endif
+}
+
+void start_sampler (void *_self) {
+
+    Application *self = _self;
+    int64_t period = self->options.tickPeriod * 1e9;
+    int64_t tick = 0;
+    bool last = false;
+
+    while (!last) {
+        // Wait for the next tick, skipping the ones missed to stay on the grid
+        int64_t deadline = self->startTime + ++tick * period;
+        int64_t now = get_monotonic_time();
+        if (now > deadline) {
+            tick = (now - self->startTime) / period + 1;
+            deadline = self->startTime + tick * period;
+        }
+        sleep_until(deadline);
+
+        // One more sample once the transfers are over, to get their end
+        last = !atomic_load(&self->sampling);
+
+        VertexData data;
+        memset(&data, 0, sizeof(data));
+        data.time = (deadline - self->startTime) / 1e9;
+
+        for (int i = 0; i < self->streamCount; i++) {
+            Stream *stream = &self->streams[i];
+            int64_t arrival = atomic_load_explicit(&stream->arrival, memory_order_acquire);
+            double size = atomic_load_explicit(&stream->bytes, memory_order_relaxed) / 1024.0; // KB
+
+            // Stamp the size with the arrival time of its bytes. While stalled,
+            // the tick time makes the window expire instead of freezing it.
+            double time = (arrival - self->startTime) / 1e9;
+            if (time <= stream->lastSampleTime || time > data.time) {
+                time = data.time;
+            }
+            stream->lastSampleTime = time;
+
+            // Get number of bytes per second over the last window only
+            speed_window_push(&stream->speedWindow, time, size);
+            data.streamSpeed[i] = speed_window_get_speed(&stream->speedWindow);
+            atomic_store(&stream->speed, data.streamSpeed[i]);
+            data.lastSecondSpeed += data.streamSpeed[i];
+            data.size += size;
+        }
+
+        // Get download speed, from the first byte so the setup phases don't lower it
+        int64_t firstByte = atomic_load(&self->firstByte);
+        double transferTime = (firstByte) ? (deadline - firstByte) / 1e9 : 0;
+        data.speed = (transferTime > 0) ? data.size / transferTime : 0; // KB/s
+
+        // Get the rolling estimations of the total speed
+        for (int i = 0; i < self->options.estimatorCount; i++) {
+            data.estimates[i] = estimator_push(&self->estimators[i], data.time, data.size);
+        }
+
+        // Get the TCP state of the first stream still connected
+        for (int i = 0; i < self->streamCount; i++) {
+            Stream *stream = &self->streams[i];
+            if (atomic_load_explicit(&stream->tcpValid, memory_order_acquire)) {
+                for (int series = 0; series < TCP_SERIES_COUNT; series++) {
+                    data.tcp[series] = atomic_load_explicit(&stream->tcp[series], memory_order_relaxed);
+                }
+                break;
+            }
+        }
+
+        // Get disk write speed, lagging the download while the buffers fill up
+        if (self->output) {
+            speed_window_push(&self->diskSpeedWindow, data.time, atomic_load(&self->writer.written) / 1024.0);
+            data.diskSpeed = speed_window_get_speed(&self->diskSpeedWindow);
+        }
+
+        // Push data to the shared data channel, dropped if the renderer is too late
+        if (sample_channel_push(self->dataChannel, &data)) {
+            wakeup_signal(&self->dataReady);
+        }
+    }
+
+    for (int i = 0; i < self->streamCount; i++) {
+        speed_window_print_stats (&self->streams[i].speedWindow);
+    }
+    if (self->output) {
+        speed_window_print_stats (&self->diskSpeedWindow);
+    }
+}
+
+size_t write_callback (void *buf, size_t size, size_t nmemb, Stream *stream) {
+
+    Application *self = stream->application;
+    stream_count_bytes(stream, size * nmemb);
+    read_phases(self, stream, false);
+
+    // Reserve the whole file on the first write, so it doesn't fragment or fill the disk midway
+    if (self->output && !self->writer.preallocated) {
+        curl_off_t length = self->contentLength;
+        if (!self->segmented) {
+            curl_easy_getinfo(stream->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+        }
+        if (length > 0 && !preallocate_file(self->output, length)) {
+            error("Cannot reserve %lld bytes for '%s'.", (long long) length, self->options.filename);
+        }
+        self->writer.preallocated = true;
+    }
+
+    if (self->segmented) {
+        size_t bytes = size * nmemb;
+
+        // A server ignoring the range would send the file from its start
+        if (!stream->checked) {
+            long code = 0;
+            curl_easy_getinfo(stream->curl, CURLINFO_RESPONSE_CODE, &code);
+            if (code != 206) {
+                error("The server doesn't support byte ranges (HTTP %ld).", code);
+                return 0;
+            }
+            stream->checked = true;
+        }
+
+        // Stop at the end of the range, which may have been stolen meanwhile
+        curl_off_t left = stream->end + 1 - stream->offset;
+        size_t kept = ((curl_off_t) bytes < left) ? bytes : (size_t) ((left > 0) ? left : 0);
+
+        if (kept && self->output && !disk_writer_write(&self->writer, &stream->staging, buf, kept, stream->offset)) {
+            return 0;
+        }
+        stream->offset += kept;
+
+        // Returning less than received aborts the transfer
+        return (kept == bytes) ? bytes : 0;
+    }
+
+    // Only the first stream is written to disk, never the answer to an upload
+    if (stream->index != 0 || stream->upload || !self->output) {
+        // Don't write anything to disk
+        return size * nmemb;
+    }
+
+    // The writer thread does the actual write, out of the network path
+    if (!disk_writer_write(&self->writer, &stream->staging, buf, size * nmemb, stream->offset)) {
+        return 0;
+    }
+    stream->offset += size * nmemb;
+    return size * nmemb;
+}
+
+size_t read_callback (char *buf, size_t size, size_t nmemb, Stream *stream) {
+
+    Application *self = stream->application;
+    curl_off_t total = (curl_off_t) self->options.uploadSize * 1024 * 1024;
+
+    // Send the generated buffer again and again, up to the upload size
+    size_t offset = stream->uploaded % UPLOAD_BUFFER_SIZE;
+    size_t bytes = size * nmemb;
+    if (bytes > UPLOAD_BUFFER_SIZE - offset) {
+        bytes = UPLOAD_BUFFER_SIZE - offset;
+    }
+    if ((curl_off_t) bytes > total - stream->uploaded) {
+        bytes = total - stream->uploaded;
+    }
+
+    memcpy(buf, self->uploadData + offset, bytes);
+    stream->uploaded += bytes;
+    stream_count_bytes(stream, bytes);
+
+    return bytes;
+}
+
+curl_off_t probe_content_length (char *url) {
+
+    CURL *curl = curl_easy_init ();
+    curl_off_t length = -1;
+
+    curl_easy_setopt (curl, CURLOPT_URL, url);
+    curl_easy_setopt (curl, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt (curl, CURLOPT_FOLLOWLOCATION, 1L);
+
+    if (curl_easy_perform (curl) == CURLE_OK) {
+        curl_easy_getinfo (curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+    }
+
+    curl_easy_cleanup (curl);
+    return length;
+}
+
+void stream_set_range (Stream *self, curl_off_t start, curl_off_t end) {
+
+    char range[64];
+    sprintf(range, "%lld-%lld", (long long) start, (long long) end);
+    curl_easy_setopt (self->curl, CURLOPT_RANGE, range);
+
+    self->offset = start;
+    self->end = end;
+    self->checked = false;
+}
+
+bool steal_segment (Application *self, Stream *idle) {
+
+    Stream *slowest = NULL;
+    double slowestTime = 0;
+
+    // Find the range which would be the last to complete at its current speed
+    for (int i = 0; i < self->streamCount; i++) {
+        Stream *stream = &self->streams[i];
+        curl_off_t remaining = stream->end + 1 - stream->offset;
+        if (stream == idle || !stream->attached || remaining < SEGMENT_MIN_SPLIT * 2) {
+            continue;
+        }
+        double speed = atomic_load(&stream->speed) * 1024;
+        double time = remaining / ((speed > 1) ? speed : 1);
+        if (time > slowestTime) {
+            slowestTime = time;
+            slowest = stream;
+        }
+    }
+
+    if (!slowest) {
+        return false;
+    }
+
+    // The slow stream keeps the first half, the idle one takes the second
+    curl_off_t middle = slowest->offset + (slowest->end + 1 - slowest->offset) / 2;
+    curl_off_t end = slowest->end;
+    slowest->end = middle - 1;
+
+    stream_set_range(idle, middle, end);
+
+    return true;
+}
+
+bool preallocate_file (FILE *file, curl_off_t length) {
+#ifdef _WIN32
+    FILE_ALLOCATION_INFO allocation = {.AllocationSize.QuadPart = length};
+    return SetFileInformationByHandle((HANDLE) _get_osfhandle(_fileno(file)), FileAllocationInfo, &allocation, sizeof(allocation));
+#else
+    return posix_fallocate(fileno(file), 0, length) == 0;
+#endif
+}
+
+static bool disk_writer_has_work (void *_self) {
+
+    DiskWriter *self = _self;
+    sfMutex_lock(self->mutex);
+    bool work = self->queueCount || self->closing;
+    sfMutex_unlock(self->mutex);
+    return work;
+}
+
+static bool disk_writer_has_free (void *_self) {
+
+    DiskWriter *self = _self;
+    sfMutex_lock(self->mutex);
+    bool available = self->freeCount > 0;
+    sfMutex_unlock(self->mutex);
+    return available;
+}
+
+static void disk_writer_run (void *_self) {
+
+    DiskWriter *self = _self;
+
+    while (true) {
+        sfMutex_lock(self->mutex);
+        DiskBuffer *buffer = NULL;
+        if (self->queueCount) {
+            buffer = self->queue[self->queueHead];
+            self->queueHead = (self->queueHead + 1) % DISK_BUFFER_COUNT;
+            self->queueCount--;
+        }
+        bool closing = self->closing;
+        sfMutex_unlock(self->mutex);
+
+        if (!buffer) {
+            if (closing) {
+                break;
+            }
+            wakeup_wait(&self->filled, 100, disk_writer_has_work, self);
+            continue;
+        }
+
+        if (!atomic_load(&self->failed)) {
+            if (write_at(self->file, buffer->data, buffer->size, buffer->offset)) {
+                atomic_fetch_add(&self->written, buffer->size);
+            } else {
+                error("Cannot write %zu bytes at offset %lld.", buffer->size, (long long) buffer->offset);
+                atomic_store(&self->failed, true);
+            }
+        }
+
+        sfMutex_lock(self->mutex);
+        self->free[self->freeCount++] = buffer;
+        sfMutex_unlock(self->mutex);
+        wakeup_signal(&self->freed);
+    }
+}
+
+bool disk_writer_init (DiskWriter *self, FILE *file) {
+
+    memset(self, 0, sizeof(*self));
+    self->file = file;
+    atomic_init(&self->written, 0);
+    atomic_init(&self->failed, false);
+
+    for (int i = 0; i < DISK_BUFFER_COUNT; i++) {
+        DiskBuffer *buffer = &self->buffers[i];
+        if (!(buffer->block = malloc(DISK_BUFFER_SIZE + DISK_BUFFER_ALIGNMENT))) {
+            error("Cannot allocate disk buffers.");
+            return false;
+        }
+        buffer->data = (char *) (((uintptr_t) buffer->block + DISK_BUFFER_ALIGNMENT - 1) & ~((uintptr_t) DISK_BUFFER_ALIGNMENT - 1));
+        self->free[self->freeCount++] = buffer;
+    }
+
+    if (!(self->mutex = sfMutex_create())
+    ||  !(wakeup_init(&self->filled))
+    ||  !(wakeup_init(&self->freed))) {
+        error("Cannot initialize the disk writer.");
+        return false;
+    }
+
+    self->thread = sfThread_create(disk_writer_run, self);
+    sfThread_launch(self->thread);
+
+    return true;
+}
+
+void disk_writer_flush (DiskWriter *self, DiskBuffer **staging) {
+
+    DiskBuffer *buffer = *staging;
+    if (!buffer) {
+        return;
+    }
+    *staging = NULL;
+
+    sfMutex_lock(self->mutex);
+    if (buffer->size) {
+        self->queue[(self->queueHead + self->queueCount++) % DISK_BUFFER_COUNT] = buffer;
+    } else {
+        self->free[self->freeCount++] = buffer;
+    }
+    sfMutex_unlock(self->mutex);
+    wakeup_signal(&self->filled);
+}
+
+bool disk_writer_write (DiskWriter *self, DiskBuffer **staging, void *buf, size_t size, curl_off_t offset) {
+
+    while (size) {
+        if (atomic_load(&self->failed)) {
+            return false;
+        }
+
+        // A buffer holds one contiguous range of the file
+        DiskBuffer *buffer = *staging;
+        if (buffer && (buffer->size == DISK_BUFFER_SIZE || buffer->offset + (curl_off_t) buffer->size != offset)) {
+            disk_writer_flush(self, staging);
+            buffer = NULL;
+        }
+
+        // Take a free buffer, waiting for the disk only if there is none
+        while (!buffer) {
+            sfMutex_lock(self->mutex);
+            if (self->freeCount) {
+                buffer = self->free[--self->freeCount];
+            }
+            sfMutex_unlock(self->mutex);
+            if (!buffer) {
+                wakeup_wait(&self->freed, 100, disk_writer_has_free, self);
+            }
+        }
+        if (!*staging) {
+            buffer->size = 0;
+            buffer->offset = offset;
+            *staging = buffer;
+        }
+
+        size_t copied = DISK_BUFFER_SIZE - buffer->size;
+        if (copied > size) {
+            copied = size;
+        }
+        memcpy(buffer->data + buffer->size, buf, copied);
+        buffer->size += copied;
+        buf = (char *) buf + copied;
+        size -= copied;
+        offset += copied;
+    }
+
+    return true;
+}
+
+void disk_writer_close (DiskWriter *self) {
+
+    if (!self->thread) {
+        return;
+    }
+
+    sfMutex_lock(self->mutex);
+    self->closing = true;
+    sfMutex_unlock(self->mutex);
+    wakeup_signal(&self->filled);
+
+    sfThread_wait(self->thread);
+    sfThread_destroy(self->thread);
+    self->thread = NULL;
+
+    for (int i = 0; i < DISK_BUFFER_COUNT; i++) {
+        free(self->buffers[i].block);
+    }
+    sfMutex_destroy(self->mutex);
+}
+
+bool write_at (FILE *file, void *buf, size_t size, curl_off_t offset) {
+#ifdef _WIN32
+    HANDLE handle = (HANDLE) _get_osfhandle(_fileno(file));
+    OVERLAPPED overlapped = {
+        .Offset = (DWORD) offset,
+        .OffsetHigh = (DWORD) (offset >> 32)
+    };
+    DWORD written;
+    return WriteFile(handle, buf, size, &written, &overlapped) && written == size;
+#else
+    int fd = fileno(file);
+    while (size) {
+        ssize_t written = pwrite(fd, buf, size, offset);
+        if (written <= 0) {
+            return false;
+        }
+        buf = (char *) buf + written;
+        size -= written;
+        offset += written;
+    }
+    return true;
+#endif
+}
+
+// Decimate the live curves if there are more vertices than the screen can show
+void decimate_curves (Graphics *graphics) {
+
+    // A series holds one vertex per tick over the axis, so this only happens when the tick
+    // is shorter than the time of a pixel column (--tick under 1 / X_TILE_SIZE seconds)
+    void decimate_series (PlotSeries *series, sfVertex *decimated, size_t *decimatedCount) {
+        *decimatedCount = 0;
+        if (series->count > (size_t) graphics->axisSize.x) {
+            *decimatedCount = m4_decimate(
+                plot_series_get_vertices(series), series->count,
+                graphics->startAxisTime - graphics->timeOrigin, X_TILE_SIZE,
+                decimated);
+        }
+    }
+    decimate_series(&graphics->averageBandwith, graphics->decimated[HISTORY_AVERAGE], &graphics->decimatedCount[HISTORY_AVERAGE]);
+    decimate_series(&graphics->currentBandwith, graphics->decimated[HISTORY_CURRENT], &graphics->decimatedCount[HISTORY_CURRENT]);
+    decimate_series(&graphics->diskBandwith, graphics->decimated[HISTORY_DISK], &graphics->decimatedCount[HISTORY_DISK]);
+    for (int series = 0; series < TCP_SERIES_COUNT; series++) {
+        decimate_series(&graphics->tcpSeries[series], graphics->tcpDecimated[series], &graphics->tcpDecimatedCount[series]);
+    }
+    for (int i = 0; i < graphics->estimatorCount; i++) {
+        if (graphics->estimatorShown[i]) {
+            decimate_series(&graphics->estimatorSeries[i], graphics->estimatorDecimated[i], &graphics->estimatorDecimatedCount[i]);
+        }
+    }
+    for (int i = 0; i < graphics->streamCount; i++) {
+        decimate_series(&graphics->streamBandwith[i], graphics->streamDecimated[i], &graphics->streamDecimatedCount[i]);
+    }
+}
+
+// Give a scale and offset transform to the log shader, and get the transform to draw with instead
+sfTransform set_log_shader_transform (Graphics *graphics, sfTransform transform) {
+    const float *m = transform.matrix;
+    sfShader_setVec4Uniform (graphics->logShader, "plotTransform", (sfGlslVec4) {m[0], m[2], m[4], m[5]});
+    return sfTransform_Identity;
+}
+
+// Draw vertices of the live view in the plot texture, with a given value at the top of the Y axis.
+// The strip is drawn a second time one texture width to the left when it goes past the right edge.
+void draw_plot_strip (Graphics *graphics, sfVertex *vertices, size_t count, double limit, const sfShader *shader) {
+
+    if (count < 2) {
+        return;
+    }
+
+    double width = graphics->axisSize.x;
+    double wraps = floor((graphics->timeOrigin + vertices[0].position.x) * X_TILE_SIZE / width);
+    double shift = graphics->timeOrigin * X_TILE_SIZE - wraps * width;
+
+    sfRenderStates states = {
+        .blendMode = sfBlendAlpha,
+        .transform = sfTransform_fromMatrix (
+            X_TILE_SIZE, 0, shift,
+            0, -graphics->axisSize.y / limit, graphics->axisSize.y,
+            0, 0, 1
+        ),
+        .texture = NULL,
+        .shader = shader
+    };
+    if (shader) {
+        states.transform = set_log_shader_transform (graphics, states.transform);
+    }
+    sfRenderTexture_drawPrimitives (graphics->plotTexture, vertices, count, sfLinesStrip, &states);
+
+    if (vertices[count - 1].position.x * X_TILE_SIZE + shift >= width) {
+        states.transform = sfTransform_fromMatrix (
+            X_TILE_SIZE, 0, shift - width,
+            0, -graphics->axisSize.y / limit, graphics->axisSize.y,
+            0, 0, 1
+        );
+        if (shader) {
+            states.transform = set_log_shader_transform (graphics, states.transform);
+        }
+        sfRenderTexture_drawPrimitives (graphics->plotTexture, vertices, count, sfLinesStrip, &states);
+    }
+}
+
+// Bring the plot texture up to date : only the newest segments of the curves, over the columns
+// cleared for them, unless the Y axis or the curves shown changed since the previous frame
+void update_plot_texture (Graphics *graphics) {
+
+    const sfShader *shader = (graphics->logScale) ? graphics->logShader : NULL;
+    double limit = get_axis_value (graphics, graphics->limitSpeed);
+    PlotSeries *reference = &graphics->averageBandwith;
+    size_t pending = graphics->plotPending;
+    graphics->plotPending = 0;
+
+    if (!reference->count) {
+        return;
+    }
+
+    sfVertex *newest = &plot_series_get_vertices (reference)[reference->count - 1];
+    bool full = graphics->plotDirty
+        || graphics->plotLimit != graphics->limitSpeed || graphics->plotLogScale != graphics->logScale
+        || pending + 1 > reference->count
+        || (pending && (newest->position.x - newest[-pending].position.x) * X_TILE_SIZE >= graphics->axisSize.x);
+
+    // Draw the newest points of a series, joined to the last point drawn before them
+    void draw_series (PlotSeries *series, sfVertex *decimated, size_t decimatedCount, double limit, const sfShader *shader) {
+        if (full && decimatedCount) {
+            draw_plot_strip (graphics, decimated, decimatedCount, limit, shader);
+        } else if (full) {
+            draw_plot_strip (graphics, plot_series_get_vertices (series), series->count, limit, shader);
+        } else {
+            size_t count = (pending + 1 < series->count) ? pending + 1 : series->count;
+            draw_plot_strip (graphics, plot_series_get_vertices (series) + series->count - count, count, limit, shader);
+        }
+    }
 
-    // Get total size
-    double size;
-    curl_easy_getinfo(self->curl, CURLINFO_SIZE_DOWNLOAD, &size);
-
-    VertexData *data = malloc(sizeof(VertexData));
-    data->time = time;
-    data->size = size / 1024;
-    bb_queue_add(&lastSecondQueue, data);
-
-    // Update every tick
-    if (time - lastTime >= UPDATE_TICK_FREQUENCY) {
-        lastTime = time;
-
-        // Get download speed
-        double speed;
-        curl_easy_getinfo(self->curl, CURLINFO_SPEED_DOWNLOAD, &speed);
-        data->speed = speed / 1024; // KB/s
-
-        // Get number of bytes during the last second only
-        double bytesCount = 0;
-        double lastBytesCount = 0;
-        foreach_bbqueue_item(&lastSecondQueue, VertexData *data) {
-            if (data->time <= time && data->time >= (time - 1)) {
-                if (lastBytesCount == 0) {
-                    lastBytesCount = data->size;
-                }
-                bytesCount += (data->size - lastBytesCount);
-                lastBytesCount = data->size;
-            } else if (time >= (data->time + 20)) {
-                // Don't keep more than 20 seconds of cache
-                bb_queue_add(&clearQueue, data);
-            }
+    if (full) {
+        decimate_curves (graphics);
+        sfRenderTexture_clear (graphics->plotTexture, sfTransparent);
+        graphics->plotDirty = false;
+        graphics->plotLimit = graphics->limitSpeed;
+        graphics->plotLogScale = graphics->logScale;
+    } else if (pending) {
+        // Clear the columns the new segments cover, which still hold the curves of one axis width ago
+        double width = graphics->axisSize.x;
+        float from = fmod((graphics->timeOrigin + newest[-pending].position.x) * X_TILE_SIZE, width);
+        float to = from + (newest->position.x - newest[-pending].position.x) * X_TILE_SIZE;
+        sfVertex strip[8];
+        for (int i = 0; i < 2; i++) {
+            float left = floorf(from) + 1 - i * width;
+            float right = floorf(to) + 1 - i * width;
+            strip[i * 4 + 0] = (sfVertex) {.position = {left, 0}, .color = sfTransparent};
+            strip[i * 4 + 1] = (sfVertex) {.position = {right, 0}, .color = sfTransparent};
+            strip[i * 4 + 2] = (sfVertex) {.position = {right, graphics->axisSize.y}, .color = sfTransparent};
+            strip[i * 4 + 3] = (sfVertex) {.position = {left, graphics->axisSize.y}, .color = sfTransparent};
         }
-        // Cleanup
-        while (bb_queue_get_length(&clearQueue)) {
-            VertexData *data = bb_queue_pop(&clearQueue);
-            bb_queue_remv(&lastSecondQueue, data);
-            free(data);
+        sfRenderStates clearStates = {
+            .blendMode = sfBlendNone,
+            .transform = sfTransform_Identity,
+            .texture = NULL,
+            .shader = NULL
+        };
+        sfRenderTexture_drawPrimitives (graphics->plotTexture, strip, 8, sfQuads, &clearStates);
+    } else {
+        return;
+    }
+
+    for (int i = 0; i < graphics->streamCount; i++) {
+        draw_series (&graphics->streamBandwith[i], graphics->streamDecimated[i], graphics->streamDecimatedCount[i], limit, shader);
+    }
+    draw_series (&graphics->averageBandwith, graphics->decimated[HISTORY_AVERAGE], graphics->decimatedCount[HISTORY_AVERAGE], limit, shader);
+    draw_series (&graphics->currentBandwith, graphics->decimated[HISTORY_CURRENT], graphics->decimatedCount[HISTORY_CURRENT], limit, shader);
+    if (graphics->diskCurve) {
+        draw_series (&graphics->diskBandwith, graphics->decimated[HISTORY_DISK], graphics->decimatedCount[HISTORY_DISK], limit, shader);
+    }
+    for (int i = 0; i < graphics->estimatorCount; i++) {
+        if (graphics->estimatorShown[i]) {
+            draw_series (&graphics->estimatorSeries[i], graphics->estimatorDecimated[i], graphics->estimatorDecimatedCount[i], limit, shader);
         }
-        data->lastSecondSpeed = bytesCount;
+    }
 
-        // Push data to the shared data queue
-        sfMutex_lock(self->mutex);
-        bb_queue_push(self->dataQueue, data);
-        sfMutex_unlock(self->mutex);
+    // TCP state, each series on its own linear scale
+    if (graphics->tcpOverlay) {
+        for (int series = 0; series < TCP_SERIES_COUNT; series++) {
+            draw_series (&graphics->tcpSeries[series], graphics->tcpDecimated[series], graphics->tcpDecimatedCount[series],
+                graphics->tcpLimit[series], NULL);
+        }
     }
 
-    return 0;
+    sfRenderTexture_display (graphics->plotTexture);
 }
 
-size_t write_callback (void *buf, size_t size, size_t nmemb, Application *self) {
-    if (!self->output) {
-        // Don't write anything to disk
-        return size * nmemb;
+// Draw the axis and legends in the static layer
+void update_static_texture (Graphics *graphics) {
+
+    sfRenderTexture *layer = graphics->staticTexture;
+    graphics->staticDirty = false;
+    sfRenderTexture_clear (layer, sfTransparent);
+
+    sfRenderTexture_drawRectangleShape (layer, graphics->axis[0], NULL);
+    sfRenderTexture_drawRectangleShape (layer, graphics->axis[1], NULL);
+    sfRenderTexture_drawText (layer, graphics->urlText, NULL);
+
+    sfRenderTexture_drawVertexArray (layer, graphics->legendAvgColor, NULL);
+    sfRenderTexture_drawVertexArray (layer, graphics->legendCurColor, NULL);
+    sfRenderTexture_drawText (layer, graphics->legendAvg, NULL);
+    sfRenderTexture_drawText (layer, graphics->legendCur, NULL);
+    if (graphics->diskCurve) {
+        sfRenderTexture_drawVertexArray (layer, graphics->legendDiskColor, NULL);
+        sfRenderTexture_drawText (layer, graphics->legendDisk, NULL);
+    }
+    for (int i = 0; i < graphics->streamCount; i++) {
+        sfRenderTexture_drawText (layer, graphics->streamLegend[i], NULL);
+    }
+    for (int i = 0; i < graphics->estimatorCount; i++) {
+        sfRenderTexture_drawText (layer, graphics->estimatorLegend[i], NULL);
     }
 
-    fwrite(buf, size, nmemb, self->output);
-    return size * nmemb;
+    sfRenderTexture_display (layer);
 }
 
 void render (Application *self) {
@@ -379,32 +3441,168 @@ void render (Application *self) {
     // Clear
     sfRenderWindow_clear (window, sfBlack);
 
-    // Draw axis
-    sfRenderWindow_drawRectangleShape (window, graphics->axis[0], NULL);
-    sfRenderWindow_drawRectangleShape (window, graphics->axis[1], NULL);
+    // Draw axis and legends, from the static layer
+    if (graphics->staticDirty) {
+        update_static_texture (graphics);
+    }
+    sfRenderStates layerStates = {
+        .blendMode = sfBlendAlpha,
+        .transform = sfTransform_Identity,
+        .texture = sfRenderTexture_getTexture (graphics->staticTexture),
+        .shader = NULL
+    };
+    sfVertex layer[4] = {
+        {.position = {0, 0}, .color = sfWhite, .texCoords = {0, 0}},
+        {.position = {graphics->width, 0}, .color = sfWhite, .texCoords = {graphics->width, 0}},
+        {.position = {graphics->width, graphics->height}, .color = sfWhite, .texCoords = {graphics->width, graphics->height}},
+        {.position = {0, graphics->height}, .color = sfWhite, .texCoords = {0, graphics->height}}
+    };
+    sfRenderWindow_drawPrimitives (window, layer, 4, sfQuads, &layerStates);
 
     // Draw bandwith text and curves
     sfRenderWindow_drawText (window, graphics->avgBandwidthText, NULL);
     sfRenderWindow_drawText (window, graphics->currentBandwithText, NULL);
-    sfRenderWindow_drawVertexArray (window, graphics->averageBandwith, NULL);
-    sfRenderWindow_drawVertexArray (window, graphics->currentBandwith, NULL);
+
+    if (graphics->viewSpan) {
+        // History overview
+        sfRenderStates curveStates = {
+            .blendMode = sfBlendAlpha,
+            .transform = get_overview_transform (graphics),
+            .texture = NULL,
+            .shader = (graphics->logScale) ? graphics->logShader : NULL
+        };
+        if (curveStates.shader) {
+            curveStates.transform = set_log_shader_transform (graphics, curveStates.transform);
+        }
+        for (int series = 0; series < HISTORY_SERIES_COUNT; series++) {
+            if (series == HISTORY_DISK && !graphics->diskCurve) {
+                continue;
+            }
+            sfRenderWindow_drawPrimitives (window,
+                graphics->overview[series], graphics->overviewCount, sfLinesStrip, &curveStates);
+        }
+    } else {
+        // Live view, from the plot texture : the repeated texture is read from the
+        // column of the axis start, wrapping around its right edge
+        update_plot_texture (graphics);
+        float start = fmod(graphics->startAxisTime * X_TILE_SIZE, graphics->axisSize.x);
+        float left = graphics->padding.x;
+        float right = graphics->padding.x + graphics->axisSize.x;
+        float top = graphics->padding.y;
+        float bottom = graphics->padding.y + graphics->axisSize.y;
+        sfVertex plot[4] = {
+            {.position = {left, top}, .color = sfWhite, .texCoords = {start, 0}},
+            {.position = {right, top}, .color = sfWhite, .texCoords = {start + graphics->axisSize.x, 0}},
+            {.position = {right, bottom}, .color = sfWhite, .texCoords = {start + graphics->axisSize.x, graphics->axisSize.y}},
+            {.position = {left, bottom}, .color = sfWhite, .texCoords = {start, graphics->axisSize.y}}
+        };
+        layerStates.texture = sfRenderTexture_getTexture (graphics->plotTexture);
+        sfRenderWindow_drawPrimitives (window, plot, 4, sfQuads, &layerStates);
+    }
 
     // Draw download information
     sfRenderWindow_drawText (window, graphics->timeText, NULL);
     sfRenderWindow_drawText (window, graphics->sizeText, NULL);
-    sfRenderWindow_drawText (window, graphics->urlText, NULL);
     sfRenderWindow_drawText (window, graphics->maxSpeedText, NULL);
+    sfRenderWindow_drawText (window, graphics->quantileText, NULL);
+    sfRenderWindow_drawText (window, graphics->queueText, NULL);
+    sfRenderWindow_drawText (window, graphics->phaseText, NULL);
+
+    // TCP state legend, rewritten on every sample with the live values
+    if (graphics->tcpOverlay) {
+        for (int series = 0; series < TCP_SERIES_COUNT; series++) {
+            sfRenderWindow_drawText (window, graphics->tcpLegend[series], NULL);
+        }
+    }
+    if (graphics->viewSpan) {
+        sfRenderWindow_drawText (window, graphics->rangeText, NULL);
+    }
+
+    // Draw crosshair
+    if (graphics->crosshairShown) {
+        sfRenderWindow_drawPrimitives (window, graphics->crosshair, 4, sfLines, NULL);
+        sfRenderWindow_drawText (window, graphics->crosshairText, NULL);
+    }
 
-    // Draw legend
-    sfRenderWindow_drawVertexArray (window, graphics->legendAvgColor, NULL);
-    sfRenderWindow_drawVertexArray (window, graphics->legendCurColor, NULL);
-    sfRenderWindow_drawText (window, graphics->legendAvg, NULL);
-    sfRenderWindow_drawText (window, graphics->legendCur, NULL);
+    // Draw connection phases, scrolling with the live view
+    if (!graphics->viewSpan && graphics->phaseBandCount) {
+        sfRenderStates bandStates = {
+            .blendMode = sfBlendAlpha,
+            .transform = get_band_transform (graphics),
+            .texture = NULL,
+            .shader = NULL
+        };
+        sfRenderWindow_drawPrimitives (window, graphics->phaseBand, graphics->phaseBandCount, sfQuads, &bandStates);
+    }
 
     // Render to the window
     sfRenderWindow_display (window);
 }
 
+// Mouse wheel = Zoom the history around the mouse, drag = Pan the history, from the live view too
+void input_mouse (Application *self, sfEvent *event) {
+
+    Graphics *graphics = &self->graphics;
+
+    // Leave the live view for a history view showing the same span
+    void enter_history_view (void) {
+        if (!graphics->viewSpan) {
+            graphics->viewSpan = graphics->axisSize.x / X_TILE_SIZE;
+            graphics->overviewStart = graphics->startAxisTime;
+            graphics->followLatest = true;
+        }
+    }
+
+    switch (event->type) {
+        case sfEvtMouseWheelScrolled: {
+            enter_history_view();
+            float axisX = fmin(fmax(event->mouseWheelScroll.x - graphics->padding.x, 0), graphics->axisSize.x);
+            double time = graphics->overviewStart + axisX * graphics->viewSpan / graphics->axisSize.x;
+            double span = graphics->viewSpan * pow(VIEW_ZOOM_FACTOR, -event->mouseWheelScroll.delta);
+            span = fmin(fmax(span, VIEW_MIN_SPAN), viewSpans[VIEW_SPAN_COUNT - 1]);
+
+            // Keep the time under the mouse in place
+            graphics->overviewStart = time - axisX * span / graphics->axisSize.x;
+            graphics->viewSpan = span;
+            graphics->followLatest = false;
+            graphics->overviewDirty = true;
+            break;
+        }
+
+        case sfEvtMouseButtonPressed:
+            if (event->mouseButton.button == sfMouseLeft) {
+                graphics->dragging = true;
+                graphics->dragX = event->mouseButton.x;
+            }
+            break;
+
+        case sfEvtMouseButtonReleased:
+            if (event->mouseButton.button == sfMouseLeft) {
+                graphics->dragging = false;
+            }
+            break;
+
+        case sfEvtMouseMoved:
+            graphics->mouse = (sfVector2f) {event->mouseMove.x, event->mouseMove.y};
+            if (graphics->dragging && event->mouseMove.x != graphics->dragX) {
+                enter_history_view();
+                graphics->overviewStart -= (event->mouseMove.x - graphics->dragX) * graphics->viewSpan / graphics->axisSize.x;
+                graphics->dragX = event->mouseMove.x;
+                graphics->followLatest = false;
+                graphics->overviewDirty = true;
+            }
+            break;
+
+        case sfEvtMouseLeft:
+            graphics->mouse = (sfVector2f) {-1, -1};
+            graphics->dragging = false;
+            break;
+
+        default:
+            break;
+    }
+}
+
 bool input (Application *self) {
 
     // ESC = Quit
@@ -413,10 +3611,56 @@ bool input (Application *self) {
         return true;
     }
 
+    // 1, 2, 3, 4 = Live view, last 10 minutes, last hour, last day
+    Graphics *graphics = &self->graphics;
+    for (int i = 0; i < VIEW_SPAN_COUNT; i++) {
+        if (sfKeyboard_isKeyPressed (sfKeyNum1 + i) && graphics->viewSpan != viewSpans[i]) {
+            graphics->viewSpan = viewSpans[i];
+            graphics->followLatest = true;
+            graphics->overviewDirty = true;
+            graphics->plotDirty = true;
+        }
+    }
+
+    // T = Toggle the TCP state overlay, once per key press
+    static bool tcpKeyDown = false;
+    bool tcpKey = sfKeyboard_isKeyPressed (sfKeyT);
+    if (tcpKey && !tcpKeyDown) {
+        graphics->tcpOverlay = !graphics->tcpOverlay;
+        graphics->plotDirty = true;
+    }
+    tcpKeyDown = tcpKey;
+
+    // L = Toggle the log scale Y axis
+    static bool logKeyDown = false;
+    bool logKey = sfKeyboard_isKeyPressed (sfKeyL);
+    if (logKey && !logKeyDown && graphics->logShader) {
+        graphics->logScale = !graphics->logScale;
+        graphics->overviewDirty = true;
+    }
+    logKeyDown = logKey;
+
+    // F1, F2... = Toggle the rolling estimator curves
+    static bool estimatorKeyDown[MAX_ESTIMATORS];
+    for (int i = 0; i < graphics->estimatorCount; i++) {
+        bool estimatorKey = sfKeyboard_isKeyPressed (sfKeyF1 + i);
+        if (estimatorKey && !estimatorKeyDown[i]) {
+            graphics->estimatorShown[i] = !graphics->estimatorShown[i];
+            graphics->estimatorDecimatedCount[i] = 0;
+            graphics->plotDirty = true;
+            rebuild_visible_max (graphics);
+            graphics->staticDirty = true;
+            const sfUint8 *color = (graphics->estimatorShown[i]) ? estimatorColors[i] : (sfUint8[]) {255, 255, 255};
+            sfText_setColor (graphics->estimatorLegend[i], sfColor_fromRGB(color[0], color[1], color[2]));
+        }
+        estimatorKeyDown[i] = estimatorKey;
+    }
+
     return false;
 }
 
-bool init_graphics (Graphics *self, char *url) {
+bool init_graphics (Graphics *self, char **urls, bool *uploads, int urlCount, double tickPeriod, bool diskCurve,
+    EstimatorSpec *estimators, int estimatorCount, bool logScale) {
 
     sfFont *font;
 
@@ -425,6 +3669,30 @@ bool init_graphics (Graphics *self, char *url) {
 	self->height = desktop.height * 0.333;
 	self->padding = (sfVector2f) {50, 60};
 	self->startAxisTime = 0.0;
+	self->timeOrigin = 0.0;
+	self->limitSpeed = 1000;
+
+    // Log scale, drawn by a vertex shader
+    self->logShader = (sfShader_isAvailable ()) ? sfShader_createFromMemory (logVertexShader, NULL, logFragmentShader) : NULL;
+    if (logScale && !self->logShader) {
+        error("Shaders are not available, the Y axis stays linear.");
+    }
+    self->logScale = logScale && self->logShader;
+
+    // History overview, live view first
+    self->viewSpan = 0;
+    self->overviewDirty = false;
+    self->overviewCount = 0;
+    self->overviewCapacity = 0;
+    self->overviewLimit = AUTOSCALE_MIN;
+    self->overviewStart = 0;
+    self->followLatest = true;
+    self->dragging = false;
+    self->mouse = (sfVector2f) {-1, -1};
+    self->crosshairShown = false;
+    for (int series = 0; series < HISTORY_SERIES_COUNT; series++) {
+        self->overview[series] = NULL;
+    }
 
     // X Axis
     sfVector2f xAxisPos = {.x = self->padding.x, .y = self->height - self->padding.y};
@@ -442,15 +3710,75 @@ bool init_graphics (Graphics *self, char *url) {
     sfRectangleShape_setSize (yAxis, (sfVector2f) {.x = 1, .y = self->axisSize.y});
     sfRectangleShape_setFillColor (yAxis, sfWhite);
 
-    // Average bandwith vertex array
-    self->averageBandwith = sfVertexArray_create ();
-    self->averageBandwithData = sfVertexArray_create ();
-    sfVertexArray_setPrimitiveType(self->averageBandwith, sfLinesStrip);
+    // Plot texture, as big as the axis and repeated so it can be read across its right edge,
+    // and static layer, as big as the window
+    if (!(self->plotTexture = sfRenderTexture_create (self->axisSize.x, self->axisSize.y, sfFalse))
+    ||  !(self->staticTexture = sfRenderTexture_create (self->width, self->height, sfFalse))) {
+        error("Cannot create render textures.");
+        return false;
+    }
+    sfRenderTexture_setRepeated (self->plotTexture, sfTrue);
+    sfRenderTexture_clear (self->plotTexture, sfTransparent);
+    sfRenderTexture_display (self->plotTexture);
+    self->plotDirty = true;
+    self->plotPending = 0;
+    self->plotLimit = 0;
+    self->plotLogScale = false;
+    self->staticDirty = true;
+
+    // Bandwith series, big enough for one sample per tick over the whole X axis
+    size_t seriesCapacity = self->axisSize.x / X_TILE_SIZE / tickPeriod + 2;
+    if (!(plot_series_init (&self->averageBandwith, seriesCapacity))
+    ||  !(plot_series_init (&self->currentBandwith, seriesCapacity))
+    ||  !(plot_series_init (&self->diskBandwith, seriesCapacity))
+    ||  !(sliding_max_init (&self->visibleMax, seriesCapacity))) {
+        return false;
+    }
+    self->diskCurve = diskCurve;
+
+    // Streams series, only useful with several URLs
+    self->streamCount = (urlCount > 1) ? urlCount : 0;
+    for (int i = 0; i < self->streamCount; i++) {
+        self->streamDecimatedCount[i] = 0;
+        if (!(plot_series_init (&self->streamBandwith[i], seriesCapacity))
+        ||  !(self->streamDecimated[i] = malloc(sizeof(sfVertex) * 4 * ((size_t) self->axisSize.x + 1)))) {
+            error("Cannot allocate stream curves.");
+            return false;
+        }
+    }
+
+    // Decimated curves : first, min, max and last vertex of each pixel column
+    for (int series = 0; series < HISTORY_SERIES_COUNT; series++) {
+        self->decimatedCount[series] = 0;
+        if (!(self->decimated[series] = malloc(sizeof(sfVertex) * 4 * ((size_t) self->axisSize.x + 1)))) {
+            error("Cannot allocate decimated curves.");
+            return false;
+        }
+    }
+
+    // Rolling estimators, hidden until toggled
+    self->estimatorCount = estimatorCount;
+    for (int i = 0; i < estimatorCount; i++) {
+        self->estimatorShown[i] = false;
+        self->estimatorDecimatedCount[i] = 0;
+        if (!(plot_series_init (&self->estimatorSeries[i], seriesCapacity))
+        ||  !(self->estimatorDecimated[i] = malloc(sizeof(sfVertex) * 4 * ((size_t) self->axisSize.x + 1)))) {
+            error("Cannot allocate estimator curves.");
+            return false;
+        }
+    }
 
-    // Current bandwith vertex array
-    self->currentBandwith = sfVertexArray_create ();
-    self->currentBandwithData = sfVertexArray_create ();
-    sfVertexArray_setPrimitiveType(self->currentBandwith, sfLinesStrip);
+    // TCP state overlay, hidden until toggled
+    self->tcpOverlay = false;
+    for (int series = 0; series < TCP_SERIES_COUNT; series++) {
+        self->tcpLimit[series] = 1;
+        self->tcpDecimatedCount[series] = 0;
+        if (!(plot_series_init (&self->tcpSeries[series], seriesCapacity))
+        ||  !(self->tcpDecimated[series] = malloc(sizeof(sfVertex) * 4 * ((size_t) self->axisSize.x + 1)))) {
+            error("Cannot allocate TCP curves.");
+            return false;
+        }
+    }
 
     // Font
     if (!(font = sfFont_createFromFile("visitor2.ttf"))) {
@@ -487,14 +3815,45 @@ bool init_graphics (Graphics *self, char *url) {
     sfText_setCharacterSize(self->urlText, 20);
     sfText_setFont(self->urlText, font);
     sfText_setPosition(self->urlText, (sfVector2f){.x = self->width - 300, .y = 0});
-    sfText_setString(self->urlText, url);
+    sfText_setString(self->urlText, urls[0]);
 
     // Max speed text
     self->maxSpeedText = sfText_create ();
     sfText_setCharacterSize(self->maxSpeedText, 20);
     sfText_setFont(self->maxSpeedText, font);
     sfText_setPosition(self->maxSpeedText, (sfVector2f){.x = 10, .y = self->padding.y - 30});
-    sfText_setString(self->maxSpeedText, url);
+    sfText_setString(self->maxSpeedText, urls[0]);
+
+    // Percentiles text, next to the max speed
+    self->quantileText = sfText_create ();
+    sfText_setCharacterSize(self->quantileText, 15);
+    sfText_setFont(self->quantileText, font);
+    sfText_setPosition(self->quantileText, (sfVector2f){.x = 150, .y = self->padding.y - 45});
+
+    // Queue depth text
+    self->queueText = sfText_create ();
+    sfText_setCharacterSize(self->queueText, 20);
+    sfText_setFont(self->queueText, font);
+    sfText_setPosition(self->queueText, (sfVector2f){.x = self->width / 2 - 100, .y = self->height - 30});
+    self->maxBatchSize = 0;
+
+    // Connection phases text, above the queue text
+    self->phaseBandCount = 0;
+    self->phaseText = sfText_create ();
+    sfText_setCharacterSize(self->phaseText, 20);
+    sfText_setFont(self->phaseText, font);
+    sfText_setPosition(self->phaseText, (sfVector2f){.x = self->width / 2 - 100, .y = self->height - 50});
+
+    // History view range text, above the plot
+    self->rangeText = sfText_create ();
+    sfText_setCharacterSize(self->rangeText, 15);
+    sfText_setFont(self->rangeText, font);
+    sfText_setPosition(self->rangeText, (sfVector2f){.x = 150, .y = self->padding.y - 25});
+
+    // Crosshair readout, moved next to the sample
+    self->crosshairText = sfText_create ();
+    sfText_setCharacterSize(self->crosshairText, 15);
+    sfText_setFont(self->crosshairText, font);
 
     // Legend
     self->legendAvg = sfText_create ();
@@ -509,10 +3868,18 @@ bool init_graphics (Graphics *self, char *url) {
     sfText_setPosition (self->legendCur, (sfVector2f){.x = 50, .y = self->height - 50});
     sfText_setString(self->legendCur, "Current speed");
 
+    self->legendDisk = sfText_create ();
+    sfText_setCharacterSize(self->legendDisk, 20);
+    sfText_setFont(self->legendDisk, font);
+    sfText_setPosition (self->legendDisk, (sfVector2f){.x = 350, .y = self->height - 30});
+    sfText_setString(self->legendDisk, "Disk write speed");
+
     self->legendAvgColor = sfVertexArray_create ();
     self->legendCurColor = sfVertexArray_create ();
     sfVertexArray_setPrimitiveType(self->legendAvgColor, sfLinesStrip);
     sfVertexArray_setPrimitiveType(self->legendCurColor, sfLinesStrip);
+    self->legendDiskColor = sfVertexArray_create ();
+    sfVertexArray_setPrimitiveType(self->legendDiskColor, sfLinesStrip);
 
     sfVertex avgColor = {.position = {.x = 10, .y = self->height - 15}, .color = sfRed};
     sfVertex curColor = {.position = {.x = 10, .y = self->height - 35}, .color = sfYellow};
@@ -526,59 +3893,403 @@ bool init_graphics (Graphics *self, char *url) {
     sfVertexArray_append (self->legendCurColor, curColor);
     sfVertexArray_append (self->legendCurColor, curColor2);
 
+    sfVertex diskColor = {.position = {.x = 310, .y = self->height - 15}, .color = sfGreen};
+    sfVertex diskColor2 = diskColor;
+    diskColor2.position.x += 30;
+    sfVertexArray_append (self->legendDiskColor, diskColor);
+    sfVertexArray_append (self->legendDiskColor, diskColor2);
+
+    // Streams legend, under the URL text
+    for (int i = 0; i < self->streamCount; i++) {
+        char string[100];
+        snprintf(string, sizeof(string), "%d. %s%s", i + 1, (urls[i]) ? urls[i] : "?", (uploads && uploads[i]) ? " (upload)" : "");
+        self->streamLegend[i] = sfText_create ();
+        sfText_setCharacterSize(self->streamLegend[i], 20);
+        sfText_setFont(self->streamLegend[i], font);
+        sfText_setColor(self->streamLegend[i], sfColor_fromRGB(streamColors[i][0], streamColors[i][1], streamColors[i][2]));
+        sfText_setPosition(self->streamLegend[i], (sfVector2f){.x = self->width - 300, .y = 20 * (i + 1)});
+        sfText_setString(self->streamLegend[i], string);
+    }
+
+    // Estimators legend, in the top left corner of the plot
+    for (int i = 0; i < self->estimatorCount; i++) {
+        char name[32], string[64];
+        estimator_get_name(&estimators[i], name, sizeof(name));
+        snprintf(string, sizeof(string), "F%d. %s", i + 1, name);
+        self->estimatorLegend[i] = sfText_create ();
+        sfText_setCharacterSize(self->estimatorLegend[i], 15);
+        sfText_setFont(self->estimatorLegend[i], font);
+        sfText_setPosition(self->estimatorLegend[i], (sfVector2f){.x = self->padding.x + 10, .y = self->padding.y + 18 * i});
+        sfText_setString(self->estimatorLegend[i], string);
+    }
+
+    // TCP state legend, bottom right
+    for (int series = 0; series < TCP_SERIES_COUNT; series++) {
+        const sfUint8 *color = tcpColors[series];
+        self->tcpLegend[series] = sfText_create ();
+        sfText_setCharacterSize(self->tcpLegend[series], 20);
+        sfText_setFont(self->tcpLegend[series], font);
+        sfText_setColor(self->tcpLegend[series], sfColor_fromRGB(color[0], color[1], color[2]));
+        sfText_setPosition(self->tcpLegend[series], (sfVector2f){.x = self->width - 300, .y = self->height - 30 - 20 * series});
+    }
+
     return true;
 }
 
-bool application_init (Application *self, char *url, char *filename) {
+bool application_init (Application *self, Options *options) {
 
     memset(self, 0, sizeof(*self));
+    self->options = *options;
+    atomic_init(&self->downloadDone, false);
+    atomic_init(&self->stopRequested, false);
 
-    // Initialize SFML
-    if (!(init_sfml (&self->window))) {
-        error ("Cannot initialize window.");
-        return false;
+    // Initialize SFML, unless there is no display
+    if (!options->headless) {
+        if (!(init_sfml (&self->window))) {
+            error ("Cannot initialize window.");
+            return false;
+        }
     }
 
-    // Initialize CURL
-    if (!(init_curl (&self->curl, url))) {
-        error ("Cannot initialize window.");
-        return false;
+    // Initialize CURL, or take the samples from a sample log
+    if (options->replayFilename) {
+        if (!(sample_log_open (&self->replay, options->replayFilename))) {
+            error ("Cannot open sample log.");
+            return false;
+        }
+        options = &self->options;
+        memset(options->urls, 0, sizeof(options->urls));
+        options->urls[0] = self->replay.header->url;
+        options->urlCount = self->replay.header->streamCount;
+        options->tickPeriod = self->replay.header->tickPeriod;
+        options->estimatorCount = self->replay.header->estimatorCount;
+        memcpy(options->estimators, self->replay.header->estimators, sizeof(EstimatorSpec) * options->estimatorCount);
+    }
+    else {
+        // One URL downloaded by ranges over several connections
+        curl_off_t length = -1;
+        if (options->segments > 1 && options->urlCount == 1) {
+            if ((length = probe_content_length (options->urls[0])) < (curl_off_t) options->segments) {
+                error ("Cannot get the size of '%s', downloading it in one piece.", options->urls[0]);
+            } else {
+                options = &self->options;
+                options->urlCount = (options->segments < MAX_STREAMS) ? options->segments : MAX_STREAMS;
+                for (int i = 1; i < options->urlCount; i++) {
+                    options->urls[i] = options->urls[0];
+                }
+                self->segmented = true;
+                self->contentLength = length;
+            }
+        } else if (options->segments > 1) {
+            error ("Segmented download only works with one URL.");
+        }
+        if (self->segmented && options->mode != TRANSFER_DOWNLOAD) {
+            error ("Segmented download cannot be mixed with uploads.");
+            return false;
+        }
+
+        // Generate the data to upload once, the read callback only copies it to CURL
+        if (options->mode != TRANSFER_DOWNLOAD) {
+            if (!(self->uploadData = malloc(UPLOAD_BUFFER_SIZE))) {
+                error ("Cannot allocate the upload buffer.");
+                return false;
+            }
+            for (size_t i = 0; i < UPLOAD_BUFFER_SIZE; i++) {
+                self->uploadData[i] = rand();
+            }
+        }
+
+        // Every URL gets a second stream uploading to it
+        int downloadCount = options->urlCount;
+        if (options->mode == TRANSFER_BIDIRECTIONAL) {
+            if (downloadCount > MAX_STREAMS / 2) {
+                error ("Bidirectional mode takes at most %d URLs, one download and one upload stream each.", MAX_STREAMS / 2);
+                return false;
+            }
+            options = &self->options;
+            for (int i = 0; i < downloadCount; i++) {
+                options->urls[options->urlCount++] = options->urls[i];
+            }
+        }
+        else if (options->mode == TRANSFER_UPLOAD) {
+            downloadCount = 0;
+        }
+
+        // One easy handle per URL, all driven by the same multi handle
+        if (!(self->multi = curl_multi_init ())) {
+            error ("Cannot initialize CURL multi handle.");
+            return false;
+        }
+        self->streamCount = options->urlCount;
+        for (int i = 0; i < self->streamCount; i++) {
+            Stream *stream = &self->streams[i];
+            stream->application = self;
+            stream->index = i;
+            atomic_init (&stream->tcpValid, false);
+            stream->tcpTime = 0;
+            stream->retries = 0;
+            stream->attached = false;
+            if (!(init_curl (&stream->curl, options->urls[i]))) {
+                error ("Cannot initialize window.");
+                return false;
+            }
+            if (!(speed_window_init (&stream->speedWindow, SPEED_WINDOW_DURATION, SPEED_WINDOW_CAPACITY))) {
+                error ("Cannot initialize speed window.");
+                return false;
+            }
+
+            // Attach Stream data to CURL callback
+            curl_easy_setopt (stream->curl, CURLOPT_XFERINFODATA, stream);
+            curl_easy_setopt (stream->curl, CURLOPT_WRITEDATA, stream);
+
+            if (i >= downloadCount) {
+                curl_off_t size = (curl_off_t) options->uploadSize * 1024 * 1024;
+                stream->upload = true;
+                curl_easy_setopt (stream->curl, CURLOPT_READFUNCTION, read_callback);
+                curl_easy_setopt (stream->curl, CURLOPT_READDATA, stream);
+                if (options->put) {
+                    curl_easy_setopt (stream->curl, CURLOPT_UPLOAD, 1L);
+                    curl_easy_setopt (stream->curl, CURLOPT_INFILESIZE_LARGE, size);
+                } else {
+                    curl_easy_setopt (stream->curl, CURLOPT_POST, 1L);
+                    curl_easy_setopt (stream->curl, CURLOPT_POSTFIELDSIZE_LARGE, size);
+                }
+            }
+
+            if (self->segmented) {
+                curl_off_t size = length / self->streamCount;
+                curl_off_t start = size * i;
+                stream_set_range (stream, start, (i == self->streamCount - 1) ? length - 1 : start + size - 1);
+            }
+        }
     }
 
     // Initialize graphics
-    if (!(init_graphics (&self->graphics, url))) {
-        error ("Cannot initialize graphics.");
-        return false;
+    if (!options->headless) {
+        bool uploads[MAX_STREAMS];
+        for (int i = 0; i < MAX_STREAMS; i++) {
+            uploads[i] = self->streams[i].upload;
+        }
+        bool diskCurve = options->filename && !options->replayFilename;
+        if (!(init_graphics (&self->graphics, options->urls, uploads, options->urlCount, options->tickPeriod, diskCurve,
+                options->estimators, options->estimatorCount, options->logScale))) {
+            error ("Cannot initialize graphics.");
+            return false;
+        }
+    }
+
+    if (options->filename && !options->replayFilename) {
+        if (!(self->output = fopen(options->filename, "w+"))) {
+            error("Cannot open '%s'.", options->filename);
+            return false;
+        }
+        if (!(disk_writer_init (&self->writer, self->output))
+        ||  !(speed_window_init (&self->diskSpeedWindow, SPEED_WINDOW_DURATION, SPEED_WINDOW_CAPACITY))) {
+            return false;
+        }
     }
 
-    if (filename) {
-        if (!(self->output = fopen(filename, "w+"))) {
-            error("Cannot open '%s'.");
+    if (options->recordFilename) {
+        if (!(self->record = sample_log_create (options->recordFilename, options->urls[0], options->urlCount, options->tickPeriod,
+                options->estimators, options->estimatorCount))) {
+            error ("Cannot create sample log.");
             return false;
         }
     }
 
-    self->mutex = sfMutex_create ();
-    self->dataQueue = bb_queue_new ();
+    history_init (&self->history);
+    pyramid_init (&self->pyramid);
+    range_tree_init (&self->rangeTree);
 
-    // Attach Application data to CURL callback
-    curl_easy_setopt (self->curl, CURLOPT_XFERINFODATA, self);
-    curl_easy_setopt (self->curl, CURLOPT_WRITEDATA, self);
+    for (int i = 0; i < options->estimatorCount; i++) {
+        if (!(estimator_init (&self->estimators[i], &options->estimators[i]))) {
+            error ("Cannot initialize speed estimator.");
+            return false;
+        }
+    }
+
+    if (!(self->dataChannel = sample_channel_new ())) {
+        error ("Cannot initialize sample channel.");
+        return false;
+    }
+
+    if (!(wakeup_init (&self->dataReady))) {
+        error ("Cannot initialize wakeup event.");
+        return false;
+    }
 
     return true;
 }
 
 void start_download (void *_self) {
     Application *self = _self;
-    curl_easy_perform (self->curl);
-    fclose(self->output);
+
+    // Sample the transfers from their own thread, at a fixed rate
+    self->startTime = get_monotonic_time ();
+    atomic_store (&self->sampling, true);
+    sfThread *sampler = sfThread_create (start_sampler, self);
+    sfThread_launch (sampler);
+
+    self->phases.start = (get_monotonic_time () - self->startTime) / 1e9;
+    for (int i = 0; i < self->streamCount; i++) {
+        curl_multi_add_handle (self->multi, self->streams[i].curl);
+        self->streams[i].attached = true;
+    }
+
+    // Drive all the transfers from this thread until they are all done
+    int running = 0;
+    bool restarted;
+    do {
+        restarted = false;
+
+        if (curl_multi_perform (self->multi, &running) != CURLM_OK) {
+            error("CURL multi handle failed.");
+            self->failed = true;
+            break;
+        }
+
+        CURLMsg *message;
+        int pending;
+        while ((message = curl_multi_info_read (self->multi, &pending))) {
+            if (message->msg != CURLMSG_DONE) {
+                continue;
+            }
+
+            Stream *stream = NULL;
+            for (int i = 0; i < self->streamCount; i++) {
+                if (self->streams[i].curl == message->easy_handle) {
+                    stream = &self->streams[i];
+                }
+            }
+            if (!stream) {
+                continue;
+            }
+            read_phases (self, stream, true);
+            curl_multi_remove_handle (self->multi, stream->curl);
+            stream->attached = false;
+            atomic_store (&stream->tcpValid, false);
+
+            // A segment aborted on purpose because its end was stolen is complete
+            bool complete = (self->segmented)
+                ? stream->offset > stream->end
+                : message->data.result == CURLE_OK;
+
+            if (!complete && self->segmented && stream->retries < SEGMENT_MAX_RETRIES) {
+                // Resume the range where it stopped, the bytes already received are kept
+                stream->retries++;
+                info("Segment %d failed : %s, resuming at %lld.", stream->index + 1,
+                    curl_easy_strerror (message->data.result), (long long) stream->offset);
+                stream_set_range (stream, stream->offset, stream->end);
+                curl_multi_add_handle (self->multi, stream->curl);
+                stream->attached = true;
+                restarted = true;
+            }
+            else if (!complete) {
+                error("Download of '%s' failed : %s", self->options.urls[stream->index], curl_easy_strerror (message->data.result));
+                self->failed = true;
+            }
+            else if (self->segmented && steal_segment (self, stream)) {
+                // Help the slowest segment with the connection just freed
+                curl_multi_add_handle (self->multi, stream->curl);
+                stream->attached = true;
+                restarted = true;
+            }
+        }
+
+        if (running) {
+            curl_multi_wait (self->multi, NULL, 0, 100, NULL);
+
+            // Keep the TCP state fresh while a stream is stalled and its callbacks are not called
+            int64_t now = get_monotonic_time ();
+            for (int i = 0; i < self->streamCount; i++) {
+                if (self->streams[i].attached) {
+                    stream_read_tcp_info (&self->streams[i], now);
+                }
+            }
+        }
+    } while ((running || restarted) && !atomic_load (&self->stopRequested));
+
+    // Interrupted : detach the transfers still running, the data they staged is written below
+    if (running) {
+        for (int i = 0; i < self->streamCount; i++) {
+            if (self->streams[i].attached) {
+                curl_multi_remove_handle (self->multi, self->streams[i].curl);
+                self->streams[i].attached = false;
+            }
+        }
+        if (self->output) {
+            info("Download interrupted, '%s' is incomplete.", self->options.filename);
+        }
+    }
+
+    // Write what is left before sampling the disk one last time
+    if (self->output) {
+        for (int i = 0; i < self->streamCount; i++) {
+            disk_writer_flush (&self->writer, &self->streams[i].staging);
+        }
+        disk_writer_close (&self->writer);
+    }
+
+    atomic_store (&self->sampling, false);
+    sfThread_wait (sampler);
+    sfThread_destroy (sampler);
+
+    if (self->output) {
+        fclose(self->output);
+    }
+    atomic_store(&self->downloadDone, true);
+}
+
+void start_replay (void *_self) {
+
+    Application *self = _self;
+    SampleLog *log = &self->replay;
+    double speed = self->options.replaySpeed;
+    sfClock *clock = sfClock_create ();
+
+    for (size_t i = 0; i < log->count && !atomic_load (&self->stopRequested); i++) {
+        VertexData *data = &log->records[i];
+
+        // Wait for the sample time, unless replaying as fast as possible
+        if (speed > 0) {
+            double delay = data->time / speed - sfTime_asSeconds (sfClock_getElapsedTime (clock));
+            if (delay > 0) {
+                sfSleep (sfSeconds (delay));
+            }
+        }
+
+        // Unlike CURL, the replay can wait for the renderer
+        while (!sample_channel_push (self->dataChannel, data) && !atomic_load (&self->stopRequested)) {
+            sfSleep (sfMilliseconds (1));
+        }
+        wakeup_signal (&self->dataReady);
+    }
+
+    sfClock_destroy (clock);
+    atomic_store(&self->downloadDone, true);
+}
+
+// Start the thread producing the samples
+sfThread *start_producer (Application *self) {
+    sfThread *thread = sfThread_create ((self->replay.base) ? start_replay : start_download, self);
+    sfThread_launch (thread);
+    return thread;
 }
 
 void application_run (Application *self) {
 
     // Start downloading
-    sfThread *curlThread = sfThread_create (start_download, self);
-    sfThread_launch (curlThread);
+    sfThread *producer = start_producer (self);
+
+    bool has_sample (void *channel) {
+        return !sample_channel_is_empty (channel);
+    }
+
+    sfClock *frameClock = sfClock_create ();
+    float framePeriod = 1.0 / FRAME_RATE_LIMIT;
+    bool dirty = true;
+    size_t busyFrames = 0;
+    size_t idleFrames = 0;
 
     // Main loop
     while (sfRenderWindow_isOpen(self->window)) {
@@ -589,39 +4300,290 @@ void application_run (Application *self) {
             if (event.type == sfEvtClosed) {
                 sfRenderWindow_close (self->window);
             }
+            input_mouse (self, &event);
+            dirty = true;
         }
 
         // Process inputs
         input (self);
         // Update graphics
-        update (self);
-        // Render to window
-        render (self);
+        if (update (self)) {
+            dirty = true;
+        }
+
+        // Render to window only when something changed, at most FRAME_RATE_LIMIT times per second
+        float elapsed = sfTime_asSeconds (sfClock_getElapsedTime (frameClock));
+        if (dirty && elapsed >= framePeriod) {
+            update_crosshair (self);
+            render (self);
+            sfClock_restart (frameClock);
+            dirty = false;
+            busyFrames++;
+        } else {
+            idleFrames++;
+        }
+
+        // Sleep until the next sample, the next frame or the next window events poll
+        int timeout = (dirty) ? ceil((framePeriod - elapsed) * 1000) : IDLE_POLL_PERIOD;
+        wakeup_wait (&self->dataReady, (timeout > 0) ? timeout : 0, has_sample, self->dataChannel);
+    }
+
+    // The CURL handles are cleaned up by the caller, the producer must be done with them first
+    atomic_store (&self->stopRequested, true);
+    sfThread_wait (producer);
+    sfThread_destroy (producer);
+
+    info("Frames : %zu rendered, %zu idle.", busyFrames, idleFrames);
+    quantile_sketch_print (&self->quantiles);
+    sfClock_destroy (frameClock);
+}
+
+void application_run_headless (Application *self) {
+
+    static VertexData batch[SAMPLE_CHANNEL_CAPACITY];
+
+    FILE *csv = stdout;
+    if (self->options.csvFilename) {
+        if (!(csv = fopen(self->options.csvFilename, "w"))) {
+            error("Cannot open '%s'.", self->options.csvFilename);
+            return;
+        }
+    }
+
+    // Samples are only flushed to the file when the buffer is full
+    setvbuf(csv, NULL, _IOFBF, HEADLESS_BUFFER_SIZE);
+    fprintf(csv, "time,bytes,average_kbps,current_kbps,disk_kbps,rtt_ms,cwnd,retransmits,rcv_space_kb");
+    int streamCount = (self->options.urlCount > 1) ? self->options.urlCount : 0;
+    for (int i = 0; i < streamCount; i++) {
+        fprintf(csv, ",stream%d_kbps", i + 1);
+    }
+    for (int i = 0; i < self->options.estimatorCount; i++) {
+        char name[32];
+        estimator_get_name (&self->options.estimators[i], name, sizeof(name));
+        fprintf(csv, ",%s_kbps", name);
+    }
+    fprintf(csv, "\n");
+
+    // Start downloading
+    sfThread *curlThread = start_producer (self);
+
+    // Drain the channel periodically instead of being woken up on every sample
+    bool done;
+    do {
+        done = atomic_load(&self->downloadDone);
+        sfSleep (sfMilliseconds (HEADLESS_FLUSH_PERIOD));
+
+        size_t count;
+        while ((count = sample_channel_pop_batch (self->dataChannel, batch, SAMPLE_CHANNEL_CAPACITY))) {
+            if (self->record) {
+                sample_log_write (self->record, batch, count);
+            }
+            for (size_t i = 0; i < count; i++) {
+                VertexData *data = &batch[i];
+                if (data->size > 0) {
+                    quantile_sketch_push (&self->quantiles, data->time, data->lastSecondSpeed);
+                }
+                fprintf(csv, "%.6f,%.0f,%.3f,%.3f,%.3f,%.3f,%.0f,%.0f,%.0f",
+                    data->time, data->size * 1024, data->speed, data->lastSecondSpeed, data->diskSpeed,
+                    data->tcp[TCP_RTT], data->tcp[TCP_CWND], data->tcp[TCP_RETRANSMITS], data->tcp[TCP_RCV_SPACE]);
+                for (int stream = 0; stream < streamCount; stream++) {
+                    fprintf(csv, ",%.3f", data->streamSpeed[stream]);
+                }
+                for (int estimator = 0; estimator < self->options.estimatorCount; estimator++) {
+                    fprintf(csv, ",%.3f", data->estimates[estimator]);
+                }
+                fputc('\n', csv);
+            }
+        }
+    } while (!done);
+
+    if (sample_channel_get_dropped (self->dataChannel)) {
+        info("%zu samples dropped.", sample_channel_get_dropped (self->dataChannel));
+    }
+    quantile_sketch_print (&self->quantiles);
 
-        Sleep(1);
+    if (csv != stdout) {
+        fclose(csv);
+    } else {
+        fflush(csv);
     }
+
+    sfThread_wait (curlThread);
+    sfThread_destroy (curlThread);
 }
 
 int main (int argc, char **argv)
 {
     // === Process parameters ===
-    char *url = (argc >= 2) ? argv[1] : "test-debit.free.fr/image.iso";
-    char *filename = (argc >= 3) ? argv[2] : NULL;
+    Options options = {
+        .urls = {"test-debit.free.fr/image.iso"},
+        .urlCount = 1,
+        .filename = NULL,
+        .headless = false,
+        .csvFilename = NULL,
+        .tickPeriod = UPDATE_TICK_FREQUENCY,
+        .segments = 1,
+        .mode = TRANSFER_DOWNLOAD,
+        .uploadSize = 0,
+        .put = false,
+        .recordFilename = NULL,
+        .replayFilename = NULL,
+        .replaySpeed = 1.0,
+        .servePort = -1,
+        .local = false,
+        .profile = "constant:10240",
+        .serveSize = TEST_SERVER_CONTENT_SIZE
+    };
+
+    int positional = 0;
+    bool urlGiven = false; // urls[0] is still the default URL until then
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--headless")) {
+            options.headless = true;
+        } else if (!strcmp(argv[i], "--csv") && i + 1 < argc) {
+            options.csvFilename = argv[++i];
+        } else if (!strcmp(argv[i], "--tick") && i + 1 < argc) {
+            options.tickPeriod = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--segments") && i + 1 < argc) {
+            options.segments = atoi(argv[++i]);
+        } else if ((!strcmp(argv[i], "--window") || !strcmp(argv[i], "--ewma")) && i + 1 < argc) {
+            // Rolling estimators, by duration or half-life in seconds
+            EstimatorType type = (!strcmp(argv[i], "--window")) ? ESTIMATOR_WINDOW : ESTIMATOR_EWMA;
+            double duration = atof(argv[++i]);
+            if (!(duration > 0) || options.estimatorCount >= MAX_ESTIMATORS) {
+                error("Ignoring estimator '%s %s'.", argv[i - 1], argv[i]);
+            } else {
+                options.estimators[options.estimatorCount++] = (EstimatorSpec) {.type = type, .duration = duration};
+            }
+        } else if (!strcmp(argv[i], "--log")) {
+            options.logScale = true;
+        } else if (!strcmp(argv[i], "--upload") && i + 1 < argc) {
+            options.mode = TRANSFER_UPLOAD;
+            options.uploadSize = atol(argv[++i]);
+        } else if (!strcmp(argv[i], "--bidirectional") && i + 1 < argc) {
+            options.mode = TRANSFER_BIDIRECTIONAL;
+            options.uploadSize = atol(argv[++i]);
+        } else if (!strcmp(argv[i], "--put")) {
+            options.put = true;
+        } else if (!strcmp(argv[i], "--record") && i + 1 < argc) {
+            options.recordFilename = argv[++i];
+        } else if (!strcmp(argv[i], "--replay") && i + 1 < argc) {
+            options.replayFilename = argv[++i];
+        } else if (!strcmp(argv[i], "--replay-speed") && i + 1 < argc) {
+            options.replaySpeed = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--serve") && i + 1 < argc) {
+            options.servePort = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--local")) {
+            options.local = true;
+        } else if (!strcmp(argv[i], "--profile") && i + 1 < argc) {
+            options.profile = argv[++i];
+        } else if (!strcmp(argv[i], "--serve-size") && i + 1 < argc) {
+            options.serveSize = atol(argv[++i]);
+        } else if (!strcmp(argv[i], "--url") && i + 1 < argc) {
+            // Additional URLs, downloaded in parallel with the first one, which they replace if it is the default one
+            if (!urlGiven) {
+                options.urls[0] = argv[++i];
+                urlGiven = true;
+            } else if (options.urlCount < MAX_STREAMS) {
+                options.urls[options.urlCount++] = argv[++i];
+            } else {
+                error("Too many URLs, ignoring '%s'.", argv[++i]);
+            }
+        } else if (positional == 0) {
+            // The positional URL stays the first one, even after --url
+            if (!urlGiven) {
+                options.urls[0] = argv[i];
+            } else if (options.urlCount < MAX_STREAMS) {
+                memmove(&options.urls[1], &options.urls[0], sizeof(char *) * options.urlCount++);
+                options.urls[0] = argv[i];
+            } else {
+                error("Too many URLs, ignoring '%s'.", argv[i]);
+            }
+            urlGiven = true;
+            positional++;
+        } else if (positional == 1) {
+            options.filename = argv[i];
+            positional++;
+        }
+    }
+
+    if (!(options.tickPeriod > 0)) {
+        options.tickPeriod = UPDATE_TICK_FREQUENCY;
+    }
+
+    // Short and long term views of both kinds by default
+    if (!options.estimatorCount) {
+        options.estimators[options.estimatorCount++] = (EstimatorSpec) {.type = ESTIMATOR_WINDOW, .duration = 5};
+        options.estimators[options.estimatorCount++] = (EstimatorSpec) {.type = ESTIMATOR_WINDOW, .duration = 30};
+        options.estimators[options.estimatorCount++] = (EstimatorSpec) {.type = ESTIMATOR_EWMA, .duration = 1};
+        options.estimators[options.estimatorCount++] = (EstimatorSpec) {.type = ESTIMATOR_EWMA, .duration = 10};
+    }
+
+    info("Usage : BandwithPlotter [--headless] [--csv <file>] [--tick <seconds>] "
+         "[--record <file>] [--replay <file>] [--replay-speed <factor, 0 for max>] "
+         "[--serve <port> | --local] [--profile <profile>] [--serve-size <MB>] [--url <url>]... [--segments <count>] "
+         "[--upload <MB> | --bidirectional <MB>] [--put] [--window <seconds>]... [--ewma <half-life>]... [--log] "
+         "<url> <output filename>");
+
+    // === Loopback test server ===
+    static TestServer server;
+    if (options.servePort >= 0 || options.local) {
+        if (!(test_server_init (&server, (options.servePort >= 0) ? options.servePort : 0, options.profile, options.serveSize))) {
+            error("Cannot start the test server.");
+            return -1;
+        }
+        info("Test server listening on 127.0.0.1:%d with profile '%s'.", server.port, options.profile);
+
+        // Serve only
+        if (!options.local) {
+            test_server_run (&server);
+            return 0;
+        }
 
-    info("Usage : BandwithPlotter <url> <output filename>", argv[0]);
+#ifndef _WIN32
+        pthread_t serverThread;
+        pthread_create (&serverThread, NULL, test_server_run, &server);
+        pthread_detach (serverThread);
+#endif
+        static char localUrl[64];
+        sprintf(localUrl, "http://127.0.0.1:%d/", server.port);
+        options.urls[0] = localUrl;
+    }
 
     // === Initialize and run the application ===
     Application appInfo;
-    if (!(application_init (&appInfo, url, filename))) {
+    if (!(application_init (&appInfo, &options))) {
         error("Cannot initialize application correctly.");
         return -1;
     }
 
-    application_run (&appInfo);
+    if (options.headless) {
+        application_run_headless (&appInfo);
+    } else {
+        application_run (&appInfo);
+    }
 
     // Cleanup
-    sfRenderWindow_destroy (appInfo.window);
-    curl_easy_cleanup (appInfo.curl);
+    if (appInfo.window) {
+        sfRenderWindow_destroy (appInfo.window);
+    }
+    for (int i = 0; i < appInfo.streamCount; i++) {
+        curl_easy_cleanup (appInfo.streams[i].curl);
+        speed_window_free (&appInfo.streams[i].speedWindow);
+    }
+    for (int i = 0; i < appInfo.options.estimatorCount; i++) {
+        speed_window_free (&appInfo.estimators[i].window);
+    }
+    speed_window_free (&appInfo.diskSpeedWindow);
+    history_free (&appInfo.history);
+    if (appInfo.multi) {
+        curl_multi_cleanup (appInfo.multi);
+    }
+    free (appInfo.uploadData);
+    sample_channel_free (appInfo.dataChannel);
+    if (appInfo.record) {
+        fclose (appInfo.record);
+    }
 
-    return 0;
+    return (appInfo.failed) ? 1 : 0;
 }